@@ -14,7 +14,6 @@ char const CHAR_RAMP[] = " .,:;-~!*=$%#@";
 
 int mand(double complex c)
 {
-	int iters = 0;
 	double complex z = c;
 
 	for (int i = 0; i < ITERS; i++) {
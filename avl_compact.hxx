@@ -0,0 +1,290 @@
+#ifndef PROJECTS_SILLY_AVL_COMPACT_H
+#define PROJECTS_SILLY_AVL_COMPACT_H
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.hxx"
+
+// AVL tree for lots of small keys.
+//
+// Nodes live in one vector and link to each other with 32-bit indices,
+// the height takes a single byte and there is no parent link: updates
+// remember the path from the root on a small stack instead. An int set
+// node is 16 bytes against 40 for AVLTree, which also makes more of the
+// tree fit in cache. The price is no iterators, no order statistics and
+// up to 2^32 - 1 nodes. Erased slots are reused before the vector grows.
+template <typename Key, typename Value = void, typename Compare = std::less<Key>>
+class CompactAVLTree
+{
+public:
+	using Index = std::uint32_t;
+	static constexpr Index NIL = ~Index(0);
+
+	struct Node : AVLNodeData<Key, Value> {
+		template <typename... Args>
+		explicit Node(Args &&...data)
+			: AVLNodeData<Key, Value>{std::forward<Args>(data)...}
+		{
+		}
+
+		Index left = NIL;
+		Index right = NIL; // Next free slot once erased
+		std::int8_t height = 0;
+	};
+
+	CompactAVLTree() = default;
+	explicit CompactAVLTree(const Compare &cmp)
+		: comp(cmp)
+	{
+	}
+
+	/// Inserts a key, for maps the remaining arguments build the value.
+	/// Duplicate keys are allowed, they go right of the equal ones.
+	template <typename... Args>
+	Node &insert(Key key, Args &&...value);
+
+	bool delete_key(const Key &key) { return delete_key_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool delete_key(const K &key)
+	{
+		return delete_key_impl(key);
+	}
+
+	/// The node is valid until the next insert or delete
+	const Node *search(const Key &key) const { return search_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Node *search(const K &key) const
+	{
+		return search_impl(key);
+	}
+
+	Index get_root() const { return root; }
+	const Node &node(Index idx) const { return nodes[idx]; }
+
+	std::size_t size() const { return count; }
+	/// Bytes taken by the nodes, including erased and reserved slots
+	std::size_t memory_usage() const { return nodes.capacity() * sizeof(Node); }
+
+	void reserve(std::size_t n) { nodes.reserve(n); }
+
+	void clear()
+	{
+		nodes.clear();
+		root = free_head = NIL;
+		count = 0;
+	}
+
+private:
+	// AVL trees are at most ~1.44 log2(n) high, 64 covers 2^32 nodes
+	static constexpr std::size_t MAX_DEPTH = 64;
+	using Path = std::array<Index, MAX_DEPTH>;
+
+	int height_of(Index idx) const { return idx == NIL ? -1 : nodes[idx].height; }
+	int balance_factor(Index idx) const
+	{
+		return height_of(nodes[idx].left) - height_of(nodes[idx].right);
+	}
+	void update_height(Index idx)
+	{
+		auto &nd = nodes[idx];
+		nd.height = std::max(height_of(nd.left), height_of(nd.right)) + 1;
+	}
+
+	/// Link in the parent (or root) which points to path[depth]
+	Index &link_at(const Path &path, std::size_t depth)
+	{
+		if (depth == 0)
+			return root;
+		auto &parent = nodes[path[depth - 1]];
+		return parent.left == path[depth] ? parent.left : parent.right;
+	}
+
+	Index rotate_left(Index x);
+	Index rotate_right(Index x);
+	/// Fixes height and balance of a node, returns the new subtree root
+	Index balance(Index idx);
+	/// Rebalances path[depth] and up, stops early once heights don't change
+	void retrace(const Path &path, std::size_t depth);
+
+	template <typename K>
+	const Node *search_impl(const K &key) const;
+	template <typename K>
+	bool delete_key_impl(const K &key);
+
+	std::vector<Node> nodes;
+	Index root = NIL;
+	Index free_head = NIL;
+	std::size_t count = 0;
+	[[no_unique_address]] Compare comp;
+};
+
+template <typename Key, typename Value, typename Compare>
+template <typename... Args>
+auto CompactAVLTree<Key, Value, Compare>::insert(Key key, Args &&...value)
+	-> Node &
+{
+	// Take the slot first, growing the vector moves all nodes
+	Index fresh;
+	if (free_head != NIL) {
+		fresh = free_head;
+		free_head = nodes[fresh].right;
+		nodes[fresh] = Node(std::move(key), std::forward<Args>(value)...);
+	} else {
+		assert(nodes.size() < NIL);
+		fresh = static_cast<Index>(nodes.size());
+		nodes.emplace_back(std::move(key), std::forward<Args>(value)...);
+	}
+	++count;
+
+	Path path;
+	std::size_t depth = 0;
+	for (auto cur = root; cur != NIL;) {
+		assert(depth < MAX_DEPTH);
+		path[depth++] = cur;
+		cur = comp(nodes[fresh].key, nodes[cur].key) ? nodes[cur].left
+													 : nodes[cur].right;
+	}
+
+	if (depth == 0) {
+		root = fresh;
+	} else {
+		auto &parent = nodes[path[depth - 1]];
+		(comp(nodes[fresh].key, parent.key) ? parent.left : parent.right) = fresh;
+		retrace(path, depth - 1);
+	}
+
+	return nodes[fresh];
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+bool CompactAVLTree<Key, Value, Compare>::delete_key_impl(const K &key)
+{
+	Path path;
+	std::size_t depth = 0;
+	for (auto cur = root;; ++depth) {
+		if (cur == NIL)
+			return false;
+		assert(depth < MAX_DEPTH);
+		path[depth] = cur;
+		if (comp(key, nodes[cur].key))
+			cur = nodes[cur].left;
+		else if (comp(nodes[cur].key, key))
+			cur = nodes[cur].right;
+		else
+			break;
+	}
+
+	// With two children the successor's data moves up and its slot goes
+	auto target = path[depth];
+	if (nodes[target].left != NIL && nodes[target].right != NIL) {
+		auto succ = nodes[target].right;
+		path[++depth] = succ;
+		while (nodes[succ].left != NIL) {
+			succ = nodes[succ].left;
+			path[++depth] = succ;
+		}
+		static_cast<AVLNodeData<Key, Value> &>(nodes[target]) =
+			std::move(static_cast<AVLNodeData<Key, Value> &>(nodes[succ]));
+		target = succ;
+	}
+
+	auto &nd = nodes[target];
+	link_at(path, depth) = nd.left != NIL ? nd.left : nd.right;
+	nd.left = NIL;
+	nd.right = free_head;
+	free_head = target;
+	--count;
+
+	if (depth > 0)
+		retrace(path, depth - 1);
+	return true;
+}
+
+template <typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::retrace(
+	const Path &path, std::size_t depth
+)
+{
+	while (true) {
+		auto idx = path[depth];
+		auto &link = link_at(path, depth);
+		auto old_height = nodes[idx].height;
+
+		// After an insert a rotation brings the height back to what it was
+		link = balance(idx);
+		if (nodes[link].height == old_height || depth == 0)
+			break;
+		--depth;
+	}
+}
+
+template <typename Key, typename Value, typename Compare>
+auto CompactAVLTree<Key, Value, Compare>::rotate_left(Index x) -> Index
+{
+	auto y = nodes[x].right;
+	nodes[x].right = nodes[y].left;
+	nodes[y].left = x;
+	update_height(x);
+	update_height(y);
+	return y;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto CompactAVLTree<Key, Value, Compare>::rotate_right(Index x) -> Index
+{
+	auto y = nodes[x].left;
+	nodes[x].left = nodes[y].right;
+	nodes[y].right = x;
+	update_height(x);
+	update_height(y);
+	return y;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto CompactAVLTree<Key, Value, Compare>::balance(Index idx) -> Index
+{
+	update_height(idx);
+	auto bf = balance_factor(idx);
+
+	if (bf > 1) {
+		if (balance_factor(nodes[idx].left) < 0)
+			nodes[idx].left = rotate_left(nodes[idx].left);
+		return rotate_right(idx);
+	}
+	if (bf < -1) {
+		if (balance_factor(nodes[idx].right) > 0)
+			nodes[idx].right = rotate_right(nodes[idx].right);
+		return rotate_left(idx);
+	}
+
+	return idx;
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+auto CompactAVLTree<Key, Value, Compare>::search_impl(const K &key) const
+	-> const Node *
+{
+	auto cur = root;
+	while (cur != NIL) {
+		auto &nd = nodes[cur];
+		if (comp(key, nd.key))
+			cur = nd.left;
+		else if (comp(nd.key, key))
+			cur = nd.right;
+		else
+			return &nd;
+	}
+	return nullptr;
+}
+
+#endif // End avl_compact.hxx
@@ -0,0 +1,555 @@
+#ifndef PROJECTS_SILLY_AVL_CONCURRENT_H
+#define PROJECTS_SILLY_AVL_CONCURRENT_H
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+// Concurrent AVL tree set for many readers and writers, after
+// "A Practical Concurrent Binary Search Tree" by Bronson, Casper, Chafi
+// and Olukotun (PPoPP 2010).
+//
+// Every node has a mutex and a version number. Searches take no locks:
+// they walk down hand-over-hand, reading a child and then checking that
+// the parent's version did not change, which would mean that a rotation
+// may have moved the key out of the subtree, in that case they go back up
+// one level and try again. Writers lock only the node they link a new leaf
+// to, and rebalancing locks parent, node and child top-down, so operations
+// on different subtrees never touch the same locks. Rebalancing is relaxed,
+// heights are fixed up bottom-up after the change is visible.
+// Locks are always taken top-down in the current shape of the tree, as
+// rotations change that shape lock order checkers (like TSan's) may report
+// inversions which can not actually deadlock.
+//
+// Deleted keys stay in the tree as routing nodes which are only marked as
+// absent, so nodes are never unlinked while the tree is alive and no
+// memory reclamation scheme is needed. Inserting the key again revives the
+// node. Memory is thus bounded by the number of distinct keys ever inserted.
+template <typename Key, typename Compare = std::less<Key>>
+class ConcurrentAVLTree
+{
+	struct Node {
+		explicit Node(const Key &k, Node *p)
+			: key(k)
+			, parent(p)
+		{
+		}
+
+		Node *child(int dir) const { return (dir < 0 ? left : right).load(); }
+
+		const Key key;
+		std::atomic<bool> present = true;
+		std::atomic<int> height = 0;
+		// Odd while the node is shrinking, that is a rotation is moving
+		// some of its subtree elsewhere. Bumped by 2 per rotation.
+		std::atomic<std::uint64_t> version = 0;
+		std::atomic<Node *> parent;
+		std::atomic<Node *> left = nullptr;
+		std::atomic<Node *> right = nullptr;
+		std::mutex lock;
+	};
+
+public:
+	ConcurrentAVLTree() = default;
+	ConcurrentAVLTree(const ConcurrentAVLTree &) = delete;
+	ConcurrentAVLTree &operator=(const ConcurrentAVLTree &) = delete;
+
+	~ConcurrentAVLTree() { destroy_subtree(holder.right.load()); }
+
+	/// Adds the key, returns false if it was already there
+	bool insert(const Key &key);
+
+	/// Marks the key as deleted, returns false if it was not there
+	bool delete_key(const Key &key);
+
+	bool contains(const Key &key) const;
+
+private:
+	// Result of an optimistic attempt, RETRY means that the version
+	// of the node we came from changed and the caller must re-validate
+	enum Result { NOT_FOUND, FOUND, RETRY };
+
+	static constexpr std::uint64_t SHRINKING = 1;
+
+	static bool is_shrinking(std::uint64_t ver) { return ver & SHRINKING; }
+	static int height_of(const Node *nd) { return nd ? nd->height.load() : 0; }
+	/// Blocks until the rotation that started while reading ver is done
+	static void wait_shrink(Node *nd, std::uint64_t ver)
+	{
+		if (nd->version.load() == ver)
+			std::lock_guard guard(nd->lock); // Rotations hold the node lock
+	}
+
+	int cmp(const Key &a, const Key &b) const
+	{
+		return comp(a, b) ? -1 : comp(b, a) ? 1 : 0;
+	}
+
+	/// Finds the node for the key below node, going towards dir
+	Result attempt_find(
+		const Key &key, Node *node, int dir, std::uint64_t node_ver,
+		Node *&found
+	) const;
+	Result attempt_insert(
+		const Key &key, Node *node, int dir, std::uint64_t node_ver,
+		bool &inserted
+	);
+
+	// Rebalancing, the _nl suffix means that the caller holds the locks of
+	// the nodes being changed. All return the next node which may need
+	// fixing, or nullptr if nothing else has to be done.
+	enum : int { NOTHING_REQUIRED = -1, REBALANCE_REQUIRED = -2 };
+	static int node_condition(Node *nd);
+	void fix_height_and_rebalance(Node *nd);
+	static Node *fix_height_nl(Node *nd);
+	static Node *rebalance_nl(Node *parent, Node *nd);
+	static Node *rebalance_to_right_nl(Node *parent, Node *nd, Node *nl, int hr0);
+	static Node *rebalance_to_left_nl(Node *parent, Node *nd, Node *nr, int hl0);
+	static Node *rotate_right_nl(
+		Node *parent, Node *nd, Node *nl, int hr, int hll, Node *nlr, int hlr
+	);
+	static Node *rotate_left_nl(
+		Node *parent, Node *nd, Node *nr, int hl, int hrr, Node *nrl, int hrl
+	);
+	static Node *rotate_right_over_left_nl(
+		Node *parent, Node *nd, Node *nl, int hr, int hll, Node *nlr, int hlrl
+	);
+	static Node *rotate_left_over_right_nl(
+		Node *parent, Node *nd, Node *nr, int hl, int hrr, Node *nrl, int hrlr
+	);
+
+	static void destroy_subtree(Node *nd)
+	{
+		if (!nd)
+			return;
+		destroy_subtree(nd->left.load());
+		destroy_subtree(nd->right.load());
+		delete nd;
+	}
+
+	// Sentinel above the root, the tree hangs off its right link.
+	// It never rotates so its version stays 0.
+	mutable Node holder{Key(), nullptr};
+	[[no_unique_address]] Compare comp;
+};
+
+template <typename Key, typename Compare>
+bool ConcurrentAVLTree<Key, Compare>::contains(const Key &key) const
+{
+	Node *found = nullptr;
+	while (attempt_find(key, &holder, 1, 0, found) == RETRY)
+		;
+	return found && found->present.load();
+}
+
+template <typename Key, typename Compare>
+bool ConcurrentAVLTree<Key, Compare>::delete_key(const Key &key)
+{
+	Node *found = nullptr;
+	while (attempt_find(key, &holder, 1, 0, found) == RETRY)
+		;
+	bool expected = true;
+	return found && found->present.compare_exchange_strong(expected, false);
+}
+
+template <typename Key, typename Compare>
+bool ConcurrentAVLTree<Key, Compare>::insert(const Key &key)
+{
+	bool inserted = false;
+	while (attempt_insert(key, &holder, 1, 0, inserted) == RETRY)
+		;
+	return inserted;
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::attempt_find(
+	const Key &key, Node *node, int dir, std::uint64_t node_ver, Node *&found
+) const -> Result
+{
+	while (true) {
+		auto child = node->child(dir);
+		if (node->version.load() != node_ver)
+			return RETRY;
+		if (!child)
+			return NOT_FOUND;
+
+		int c = cmp(key, child->key);
+		if (c == 0) {
+			found = child;
+			return FOUND;
+		}
+
+		auto child_ver = child->version.load();
+		if (is_shrinking(child_ver)) {
+			wait_shrink(child, child_ver);
+			if (node->version.load() != node_ver)
+				return RETRY;
+		} else if (child != node->child(dir)) {
+			if (node->version.load() != node_ver)
+				return RETRY;
+		} else {
+			// Child was valid when its version was read, go down a level
+			if (node->version.load() != node_ver)
+				return RETRY;
+			auto res = attempt_find(key, child, c, child_ver, found);
+			if (res != RETRY)
+				return res;
+		}
+		// Retry from this node
+	}
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::attempt_insert(
+	const Key &key, Node *node, int dir, std::uint64_t node_ver, bool &inserted
+) -> Result
+{
+	while (true) {
+		auto child = node->child(dir);
+		if (node->version.load() != node_ver)
+			return RETRY;
+
+		if (!child) {
+			{
+				std::lock_guard guard(node->lock);
+				if (node->version.load() != node_ver)
+					return RETRY;
+				if (node->child(dir))
+					continue; // Lost the race for this link
+
+				auto leaf = new Node(key, node);
+				leaf->height = 1;
+				(dir < 0 ? node->left : node->right).store(leaf);
+			}
+			fix_height_and_rebalance(node);
+			inserted = true;
+			return FOUND;
+		}
+
+		int c = cmp(key, child->key);
+		if (c == 0) {
+			// Keys never move between nodes, so this is the key's only node
+			bool expected = false;
+			inserted = child->present.compare_exchange_strong(expected, true);
+			return FOUND;
+		}
+
+		auto child_ver = child->version.load();
+		if (is_shrinking(child_ver)) {
+			wait_shrink(child, child_ver);
+			if (node->version.load() != node_ver)
+				return RETRY;
+		} else if (child != node->child(dir)) {
+			if (node->version.load() != node_ver)
+				return RETRY;
+		} else {
+			if (node->version.load() != node_ver)
+				return RETRY;
+			auto res = attempt_insert(key, child, c, child_ver, inserted);
+			if (res != RETRY)
+				return res;
+		}
+	}
+}
+
+template <typename Key, typename Compare>
+int ConcurrentAVLTree<Key, Compare>::node_condition(Node *nd)
+{
+	auto hn = nd->height.load();
+	auto hl = height_of(nd->left.load());
+	auto hr = height_of(nd->right.load());
+	auto bal = hl - hr;
+
+	if (bal < -1 || bal > 1)
+		return REBALANCE_REQUIRED;
+	auto hn_new = 1 + std::max(hl, hr);
+	return hn != hn_new ? hn_new : NOTHING_REQUIRED;
+}
+
+template <typename Key, typename Compare>
+void ConcurrentAVLTree<Key, Compare>::fix_height_and_rebalance(Node *nd)
+{
+	// Stops at the holder, it has no parent
+	while (nd && nd->parent.load()) {
+		auto condition = node_condition(nd);
+		if (condition == NOTHING_REQUIRED)
+			return;
+
+		if (condition != REBALANCE_REQUIRED) {
+			std::lock_guard guard(nd->lock);
+			nd = fix_height_nl(nd);
+		} else {
+			auto parent = nd->parent.load();
+			std::lock_guard parent_guard(parent->lock);
+			// Parent may have changed before we got its lock, then retry
+			if (nd->parent.load() == parent) {
+				std::lock_guard guard(nd->lock);
+				nd = rebalance_nl(parent, nd);
+			}
+		}
+	}
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::fix_height_nl(Node *nd) -> Node *
+{
+	auto c = node_condition(nd);
+	switch (c) {
+	case REBALANCE_REQUIRED:
+		return nd;
+	case NOTHING_REQUIRED:
+		return nullptr;
+	default:
+		nd->height = c;
+		return nd->parent.load();
+	}
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rebalance_nl(Node *parent, Node *nd)
+	-> Node *
+{
+	auto nl = nd->left.load();
+	auto nr = nd->right.load();
+	auto hn = nd->height.load();
+	auto hl0 = height_of(nl);
+	auto hr0 = height_of(nr);
+	auto hn_new = 1 + std::max(hl0, hr0);
+	auto bal = hl0 - hr0;
+
+	if (bal > 1)
+		return rebalance_to_right_nl(parent, nd, nl, hr0);
+	if (bal < -1)
+		return rebalance_to_left_nl(parent, nd, nr, hl0);
+	if (hn_new != hn) {
+		nd->height = hn_new;
+		return fix_height_nl(parent);
+	}
+	return nullptr;
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rebalance_to_right_nl(
+	Node *parent, Node *nd, Node *nl, int hr0
+) -> Node *
+{
+	std::lock_guard left_guard(nl->lock);
+	auto hl = nl->height.load();
+	if (hl - hr0 <= 1)
+		return nd; // Changed meanwhile, retry
+
+	auto nlr = nl->right.load();
+	auto hll0 = height_of(nl->left.load());
+	auto hlr0 = height_of(nlr);
+	if (hll0 >= hlr0)
+		return rotate_right_nl(parent, nd, nl, hr0, hll0, nlr, hlr0);
+
+	{
+		std::lock_guard lr_guard(nlr->lock);
+		auto hlr = nlr->height.load();
+		if (hll0 >= hlr)
+			return rotate_right_nl(parent, nd, nl, hr0, hll0, nlr, hlr);
+
+		auto hlrl = height_of(nlr->left.load());
+		auto b = hll0 - hlrl;
+		if (b >= -1 && b <= 1)
+			return rotate_right_over_left_nl(parent, nd, nl, hr0, hll0, nlr, hlrl);
+	}
+
+	// Double rotation would leave nl unbalanced, fix it on its own first
+	return rebalance_to_left_nl(nd, nl, nlr, hll0);
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rebalance_to_left_nl(
+	Node *parent, Node *nd, Node *nr, int hl0
+) -> Node *
+{
+	std::lock_guard right_guard(nr->lock);
+	auto hr = nr->height.load();
+	if (hl0 - hr >= -1)
+		return nd;
+
+	auto nrl = nr->left.load();
+	auto hrl0 = height_of(nrl);
+	auto hrr0 = height_of(nr->right.load());
+	if (hrr0 >= hrl0)
+		return rotate_left_nl(parent, nd, nr, hl0, hrr0, nrl, hrl0);
+
+	{
+		std::lock_guard rl_guard(nrl->lock);
+		auto hrl = nrl->height.load();
+		if (hrr0 >= hrl)
+			return rotate_left_nl(parent, nd, nr, hl0, hrr0, nrl, hrl);
+
+		auto hrlr = height_of(nrl->right.load());
+		auto b = hrr0 - hrlr;
+		if (b >= -1 && b <= 1)
+			return rotate_left_over_right_nl(parent, nd, nr, hl0, hrr0, nrl, hrlr);
+	}
+
+	return rebalance_to_right_nl(nd, nr, nrl, hrr0);
+}
+
+// Same shape as rotate_right() in avl_tree.hxx, nd is marked as shrinking
+// while its left subtree moves up so that readers in it back off.
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rotate_right_nl(
+	Node *parent, Node *nd, Node *nl, int hr, int hll, Node *nlr, int hlr
+) -> Node *
+{
+	auto ver = nd->version.load();
+	auto parent_left = parent->left.load();
+	nd->version = ver | SHRINKING;
+
+	nd->left = nlr;
+	if (nlr)
+		nlr->parent = nd;
+	nl->right = nd;
+	nd->parent = nl;
+	(parent_left == nd ? parent->left : parent->right) = nl;
+	nl->parent = parent;
+
+	auto hn_new = 1 + std::max(hlr, hr);
+	nd->height = hn_new;
+	nl->height = 1 + std::max(hll, hn_new);
+
+	nd->version = ver + 2;
+
+	auto bal_n = hlr - hr;
+	if (bal_n < -1 || bal_n > 1)
+		return nd;
+	auto bal_l = hll - hn_new;
+	if (bal_l < -1 || bal_l > 1)
+		return nl;
+	return fix_height_nl(parent);
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rotate_left_nl(
+	Node *parent, Node *nd, Node *nr, int hl, int hrr, Node *nrl, int hrl
+) -> Node *
+{
+	auto ver = nd->version.load();
+	auto parent_left = parent->left.load();
+	nd->version = ver | SHRINKING;
+
+	nd->right = nrl;
+	if (nrl)
+		nrl->parent = nd;
+	nr->left = nd;
+	nd->parent = nr;
+	(parent_left == nd ? parent->left : parent->right) = nr;
+	nr->parent = parent;
+
+	auto hn_new = 1 + std::max(hl, hrl);
+	nd->height = hn_new;
+	nr->height = 1 + std::max(hn_new, hrr);
+
+	nd->version = ver + 2;
+
+	auto bal_n = hrl - hl;
+	if (bal_n < -1 || bal_n > 1)
+		return nd;
+	auto bal_r = hrr - hn_new;
+	if (bal_r < -1 || bal_r > 1)
+		return nr;
+	return fix_height_nl(parent);
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rotate_right_over_left_nl(
+	Node *parent, Node *nd, Node *nl, int hr, int hll, Node *nlr, int hlrl
+) -> Node *
+{
+	auto ver = nd->version.load();
+	auto left_ver = nl->version.load();
+	auto parent_left = parent->left.load();
+	auto nlrl = nlr->left.load();
+	auto nlrr = nlr->right.load();
+	auto hlrr = height_of(nlrr);
+
+	nd->version = ver | SHRINKING;
+	nl->version = left_ver | SHRINKING;
+
+	nd->left = nlrr;
+	if (nlrr)
+		nlrr->parent = nd;
+	nl->right = nlrl;
+	if (nlrl)
+		nlrl->parent = nl;
+	nlr->left = nl;
+	nl->parent = nlr;
+	nlr->right = nd;
+	nd->parent = nlr;
+	(parent_left == nd ? parent->left : parent->right) = nlr;
+	nlr->parent = parent;
+
+	auto hn_new = 1 + std::max(hlrr, hr);
+	nd->height = hn_new;
+	auto hl_new = 1 + std::max(hll, hlrl);
+	nl->height = hl_new;
+	nlr->height = 1 + std::max(hl_new, hn_new);
+
+	nd->version = ver + 2;
+	nl->version = left_ver + 2;
+
+	auto bal_n = hlrr - hr;
+	if (bal_n < -1 || bal_n > 1)
+		return nd;
+	auto bal_lr = hl_new - hn_new;
+	if (bal_lr < -1 || bal_lr > 1)
+		return nlr;
+	return fix_height_nl(parent);
+}
+
+template <typename Key, typename Compare>
+auto ConcurrentAVLTree<Key, Compare>::rotate_left_over_right_nl(
+	Node *parent, Node *nd, Node *nr, int hl, int hrr, Node *nrl, int hrlr
+) -> Node *
+{
+	auto ver = nd->version.load();
+	auto right_ver = nr->version.load();
+	auto parent_left = parent->left.load();
+	auto nrll = nrl->left.load();
+	auto nrlr = nrl->right.load();
+	auto hrll = height_of(nrll);
+
+	nd->version = ver | SHRINKING;
+	nr->version = right_ver | SHRINKING;
+
+	nd->right = nrll;
+	if (nrll)
+		nrll->parent = nd;
+	nr->left = nrlr;
+	if (nrlr)
+		nrlr->parent = nr;
+	nrl->right = nr;
+	nr->parent = nrl;
+	nrl->left = nd;
+	nd->parent = nrl;
+	(parent_left == nd ? parent->left : parent->right) = nrl;
+	nrl->parent = parent;
+
+	auto hn_new = 1 + std::max(hl, hrll);
+	nd->height = hn_new;
+	auto hr_new = 1 + std::max(hrlr, hrr);
+	nr->height = hr_new;
+	nrl->height = 1 + std::max(hn_new, hr_new);
+
+	nd->version = ver + 2;
+	nr->version = right_ver + 2;
+
+	auto bal_n = hrll - hl;
+	if (bal_n < -1 || bal_n > 1)
+		return nd;
+	auto bal_rl = hr_new - hn_new;
+	if (bal_rl < -1 || bal_rl > 1)
+		return nrl;
+	return fix_height_nl(parent);
+}
+
+#endif // End avl_concurrent.hxx
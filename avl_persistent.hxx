@@ -0,0 +1,407 @@
+#ifndef PROJECTS_SILLY_AVL_PERSISTENT_H
+#define PROJECTS_SILLY_AVL_PERSISTENT_H
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.hxx"
+
+// AVL tree with path copying, for one writer and any number of readers.
+//
+// Nodes are never changed once a version is published: insert and delete
+// copy the nodes on the path from the root, rebalance the copies and then
+// publish the new root with a single atomic store. Readers take a Snapshot,
+// which pins the current root, and search it with no locks at all.
+//
+// Replaced nodes are reclaimed with epoch based reclamation. A snapshot
+// records the global epoch in a reader slot while it is alive, nodes
+// retired in epoch E are freed once every live snapshot has an epoch > E,
+// as such a snapshot must have seen a root published after they were
+// unlinked. Only the writer frees nodes, so they come from a NodeArena.
+//
+// insert(), delete_key() and reclaim() must be called from one thread at a
+// time, snapshot() and everything on a Snapshot are safe from any thread.
+template <typename Key, typename Value = void, typename Compare = std::less<Key>>
+class PersistentAVLTree
+{
+public:
+	struct Node : AVLNodeData<Key, Value> {
+		template <typename... Args>
+		explicit Node(std::uint64_t ver, Args &&...data)
+			: AVLNodeData<Key, Value>{std::forward<Args>(data)...}
+			, version(ver)
+		{
+		}
+
+		int height = 0;
+		std::uint64_t version; // Write operation which created the node
+		Node *left = nullptr;
+		Node *right = nullptr;
+	};
+
+	// Read-only view of the tree as it was when the snapshot was taken.
+	// Keeps the nodes of that version alive until it is destroyed.
+	class Snapshot
+	{
+	public:
+		Snapshot(Snapshot &&other) noexcept
+			: slot(std::exchange(other.slot, nullptr))
+			, root(std::exchange(other.root, nullptr))
+			, comp(other.comp)
+		{
+		}
+		Snapshot &operator=(Snapshot &&) = delete;
+
+		~Snapshot()
+		{
+			if (slot)
+				slot->store(0, std::memory_order_release);
+		}
+
+		const Node *search(const Key &key) const { return search_impl(key); }
+
+		template <typename K, typename C = Compare, typename = typename C::is_transparent>
+		const Node *search(const K &key) const
+		{
+			return search_impl(key);
+		}
+
+		const Node *get_root() const { return root; }
+
+	private:
+		friend class PersistentAVLTree;
+		Snapshot(std::atomic<std::uint64_t> *s, const Node *r, const Compare &c)
+			: slot(s)
+			, root(r)
+			, comp(c)
+		{
+		}
+
+		template <typename K>
+		const Node *search_impl(const K &key) const
+		{
+			auto nd = root;
+			while (nd) {
+				if (comp(key, nd->key))
+					nd = nd->left;
+				else if (comp(nd->key, key))
+					nd = nd->right;
+				else
+					break;
+			}
+			return nd;
+		}
+
+		std::atomic<std::uint64_t> *slot;
+		const Node *root;
+		[[no_unique_address]] Compare comp;
+	};
+
+	PersistentAVLTree() = default;
+	PersistentAVLTree(const PersistentAVLTree &) = delete;
+	PersistentAVLTree &operator=(const PersistentAVLTree &) = delete;
+
+	/// All snapshots must be gone by now
+	~PersistentAVLTree()
+	{
+		destroy_subtree(root.load(std::memory_order_relaxed));
+		for (auto &r : retired)
+			std::destroy_at(r.node);
+	}
+
+	/// Pins the current version for reading, lock-free
+	Snapshot snapshot() const;
+
+	/// Publishes a new version with the key added, writer only
+	template <typename... Args>
+	void insert(Key key, Args &&...value);
+
+	/// Publishes a new version without the key (if found), writer only
+	bool delete_key(const Key &key);
+
+	/// Frees retired nodes no snapshot can reach anymore, writer only.
+	/// Also runs on its own once enough nodes have been retired.
+	void reclaim();
+
+	std::size_t retired_count() const { return retired.size(); }
+
+private:
+	enum : std::size_t {
+		MAX_READERS = 256, // Snapshots alive at the same time
+		RECLAIM_BATCH = 1024,
+	};
+
+	struct alignas(64) ReaderSlot {
+		std::atomic<std::uint64_t> epoch{0}; // 0 if free
+	};
+
+	struct Retired {
+		Node *node;
+		std::uint64_t epoch;
+	};
+
+	static int height_of(const Node *nd) { return nd ? nd->height : -1; }
+	static int balance_factor(const Node *nd)
+	{
+		return height_of(nd->left) - height_of(nd->right);
+	}
+	static void update_height(Node *nd)
+	{
+		nd->height = std::max(height_of(nd->left), height_of(nd->right)) + 1;
+	}
+
+	/// Node of the version being built: old nodes are copied and retired
+	Node *own(Node *nd);
+	Node *rotate_left(Node *x);
+	Node *rotate_right(Node *x);
+	/// Fixes height and balance of an owned node, returns the new subtree root
+	Node *balance(Node *nd);
+
+	Node *insert_rec(Node *nd, Node *fresh);
+	Node *erase_rec(Node *nd, const Key &key, bool &found);
+	Node *erase_min(Node *nd, Node *&min);
+
+	/// Publishes the new root and retires the nodes it replaced
+	void publish(Node *new_root);
+	void destroy_subtree(Node *nd);
+
+	std::atomic<Node *> root{nullptr};
+	std::atomic<std::uint64_t> global_epoch{1};
+	mutable ReaderSlot readers[MAX_READERS];
+
+	// Writer-only state
+	NodeArena<Node> arena;
+	std::uint64_t write_version = 0;
+	std::vector<Node *> replaced;
+	std::vector<Retired> retired;
+	std::size_t reclaim_at = RECLAIM_BATCH;
+	[[no_unique_address]] Compare comp;
+};
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::snapshot() const -> Snapshot
+{
+	// Spread threads over the slots to keep claiming cheap
+	thread_local std::size_t hint =
+		std::hash<std::thread::id>()(std::this_thread::get_id());
+
+	for (std::size_t i = hint;; ++i) {
+		// Went around once and all slots are taken, wait for some snapshot
+		if (i != hint && (i - hint) % MAX_READERS == 0)
+			std::this_thread::yield();
+
+		auto &slot = readers[i % MAX_READERS].epoch;
+		if (slot.load(std::memory_order_relaxed) != 0)
+			continue;
+
+		// Claiming the slot with the current epoch must be visible before
+		// the root is read, otherwise the writer could miss this reader.
+		std::uint64_t expected = 0;
+		auto epoch = global_epoch.load();
+		if (slot.compare_exchange_strong(expected, epoch)) {
+			hint = i;
+			return {&slot, root.load(), comp};
+		}
+	}
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename... Args>
+void PersistentAVLTree<Key, Value, Compare>::insert(Key key, Args &&...value)
+{
+	++write_version;
+	auto fresh =
+		arena.alloc(write_version, std::move(key), std::forward<Args>(value)...);
+	publish(insert_rec(root.load(std::memory_order_relaxed), fresh));
+}
+
+template <typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::delete_key(const Key &key)
+{
+	++write_version;
+	bool found = false;
+	auto new_root = erase_rec(root.load(std::memory_order_relaxed), key, found);
+	if (found)
+		publish(new_root);
+
+	return found;
+}
+
+template <typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::publish(Node *new_root)
+{
+	root.store(new_root);
+	// Snapshots which see the epoch after this bump also see new_root
+	auto epoch = global_epoch.fetch_add(1);
+
+	for (auto nd : replaced)
+		retired.push_back({nd, epoch});
+	replaced.clear();
+
+	if (retired.size() >= reclaim_at)
+		reclaim();
+}
+
+template <typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::reclaim()
+{
+	auto min_epoch = ~std::uint64_t(0);
+	for (auto &r : readers) {
+		auto epoch = r.epoch.load();
+		if (epoch != 0)
+			min_epoch = std::min(min_epoch, epoch);
+	}
+
+	// Retired in epoch order, so free the prefix older than all readers
+	auto it = retired.begin();
+	for (; it != retired.end() && it->epoch < min_epoch; ++it)
+		arena.free(it->node);
+	retired.erase(retired.begin(), it);
+
+	// Old snapshots can hold back a lot of nodes, don't rescan too often then
+	reclaim_at = std::max<std::size_t>(RECLAIM_BATCH, 2 * retired.size());
+}
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::own(Node *nd) -> Node *
+{
+	if (nd->version == write_version)
+		return nd;
+
+	auto copy = arena.alloc(
+		write_version, static_cast<const AVLNodeData<Key, Value> &>(*nd)
+	);
+	copy->height = nd->height;
+	copy->left = nd->left;
+	copy->right = nd->right;
+	replaced.push_back(nd);
+
+	return copy;
+}
+
+// Same rotations as rotate_left()/rotate_right() in avl_tree.hxx,
+// but there are no parent links and nodes are copied before changing.
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::rotate_left(Node *x) -> Node *
+{
+	auto y = own(x->right);
+	x->right = y->left;
+	y->left = x;
+	update_height(x);
+	update_height(y);
+	return y;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::rotate_right(Node *x) -> Node *
+{
+	auto y = own(x->left);
+	x->left = y->right;
+	y->right = x;
+	update_height(x);
+	update_height(y);
+	return y;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::balance(Node *nd) -> Node *
+{
+	update_height(nd);
+	auto bf = balance_factor(nd);
+
+	if (bf > 1) {
+		if (balance_factor(nd->left) < 0)
+			nd->left = rotate_left(own(nd->left));
+		return rotate_right(nd);
+	}
+	if (bf < -1) {
+		if (balance_factor(nd->right) > 0)
+			nd->right = rotate_right(own(nd->right));
+		return rotate_left(nd);
+	}
+
+	return nd;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::insert_rec(Node *nd, Node *fresh)
+	-> Node *
+{
+	if (!nd)
+		return fresh;
+
+	auto copy = own(nd);
+	if (comp(fresh->key, nd->key))
+		copy->left = insert_rec(nd->left, fresh);
+	else
+		copy->right = insert_rec(nd->right, fresh);
+
+	return balance(copy);
+}
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::erase_rec(
+	Node *nd, const Key &key, bool &found
+) -> Node *
+{
+	if (!nd)
+		return nullptr;
+
+	// Nothing is copied on the way down, so a missing key costs nothing
+	if (comp(key, nd->key) || comp(nd->key, key)) {
+		bool go_left = comp(key, nd->key);
+		auto child = erase_rec(go_left ? nd->left : nd->right, key, found);
+		if (!found)
+			return nd;
+
+		auto copy = own(nd);
+		(go_left ? copy->left : copy->right) = child;
+		return balance(copy);
+	}
+
+	found = true;
+	replaced.push_back(nd);
+	if (!nd->left)
+		return nd->right;
+	if (!nd->right)
+		return nd->left;
+
+	// Both children, the in-order successor takes the node's place
+	Node *succ;
+	auto right = erase_min(nd->right, succ);
+	succ->left = nd->left;
+	succ->right = right;
+	return balance(succ);
+}
+
+template <typename Key, typename Value, typename Compare>
+auto PersistentAVLTree<Key, Value, Compare>::erase_min(Node *nd, Node *&min)
+	-> Node *
+{
+	if (!nd->left) {
+		min = own(nd);
+		return nd->right;
+	}
+
+	auto copy = own(nd);
+	copy->left = erase_min(nd->left, min);
+	return balance(copy);
+}
+
+template <typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::destroy_subtree(Node *nd)
+{
+	if (!nd)
+		return;
+	destroy_subtree(nd->left);
+	destroy_subtree(nd->right);
+	std::destroy_at(nd);
+}
+
+#endif // End avl_persistent.hxx
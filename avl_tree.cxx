@@ -1,327 +1,427 @@
+/* AVL tree driver, the tree itself lives in avl_tree.hxx
+ *
+ * Compile command: g++ -std=c++20 -O2 -pthread avl_tree.cxx -o avl_tree
+ * Add -DAVL_TREE_STATS to also print what the big tree's hot paths did,
+ * and -march=native (or -mavx2) for the B+-tree's vector node search.
+ * Run with --json=<path> and/or --csv=<path> to save the small benchmarks.
+ * Add -DTRACE_ENABLED to record a timeline of the tree operations, the
+ * ring buffer keeps the last TRACE_BUFFER_EVENTS of them (see trace.h).
+ */
+
 #include <cassert>
-#include <cstdlib>
 #include <algorithm>
+#include <atomic>
+#include <filesystem>
 #include <iostream>
-#include <memory>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
-#include <optional>
-#include <random>
 
+#include "avl_tree.hxx"
+#include "avl_compact.hxx"
+#include "avl_concurrent.hxx"
+#include "avl_persistent.hxx"
+#include "bplus_tree.hxx"
 #include "gen_bench.hxx"
 
 using std::cout;
 
-class AVLTree;
-
-struct Node {
-	explicit Node(int d)
-		: key(d)
-	{
-	}
-
-	int balance_factor() const
-	{
-		auto l = left ? left->height : -1;
-		auto r = right ? right->height : -1;
-		return l - r;
-	}
-
-	void update_height()
-	{
-		height =
-			std::max(left ? left->height : -1, right ? right->height : -1) + 1;
-	}
+using IntTree = AVLTree<int>;
+static_assert(sizeof(IntTree::Node) == 40 || sizeof(void *) != 8);
 
-	int key = 0;
-	int height = 0;
-	std::unique_ptr<Node> left = nullptr;
-	std::unique_ptr<Node> right = nullptr;
-	Node *parent = nullptr;
-};
-
-// Pretty printers :)
-//-------------------------------------------------------------------
-std::ostream &
-print_node_conn_line(std::ostream &os, const Node *parent, bool for_left)
+int main(int argc, char *argv[])
 {
-	// UTF-8 is broken in C++ so use vector instead,
-	// because we need to print in reversed direction & only 2 distinct chars
-	std::vector<bool> bar_or_space; // vert-bar: true, space: false
-	while (auto sparent = parent->parent) {
-		bar_or_space.insert(bar_or_space.end(), 3, false); // 3 spaces
-		// If left node, then bar as right node is below left node
-		bar_or_space.push_back(sparent->left.get() == parent);
-		parent = sparent;
-	}
-
-	std::for_each(
-		bar_or_space.crbegin(), bar_or_space.crend(),
-		[&os](bool bar) { os << (bar ? "│" : " "); }
-	);
-	os << (for_left ? "├───" : "└───");
-
-	return os;
-}
+	constexpr int N = 64;
+	IntTree tree;
+	Timer timeit;
+	Bench bench(argc, argv);
 
-std::ostream &print_node(std::ostream &os, const Node *node)
-{
+	// ***** Testing *****
+	// Sequential data
+	//-------------------------------------------
+	auto seq_data = gen_seq_ints(0, N);
+	cout << "N = " << seq_data.size() << "\n";
 
-	if (node) {
-		os << "[" << node->key << "](" << node->balance_factor() << ")\n";
-	} else {
-		os << "[]\n";
-		return os;
-	}
-	// If no child nodes
-	if (!node->left && !node->right)
-		return os;
+	for (auto i : seq_data)
+		tree.insert(i * 2); // Insert even numbers only.
+	bench.run("Seq  insert", [&] {
+		IntTree t;
+		for (auto i : seq_data)
+			t.insert(i * 2);
+		do_not_optimize(t.get_root());
+	}, N);
 
-	print_node_conn_line(os, node, true);
-	print_node(os, node->left.get());
-	print_node_conn_line(os, node, false);
-	print_node(os, node->right.get());
+	// Confirm if balanced
+	cout << "Balanced: "
+		 << (check_balanced(tree.get_root()) != UNBALANCED ? "YES" : "NO")
+		 << "\n";
 
-	return os;
-}
-//-------------------------------------------------------------------
-
-// Rotate left about X
-//     X                Y
-//   /  \              / \
-//  a    Y     =>     X   c
-//      / \          / \
-//     b   c        a  b
-void rotate_left(std::unique_ptr<Node> &x)
-{
-	assert(x->right);
-	auto y = std::move(x->right);
-
-	// Update backreferences
-	y->parent = x->parent;
-	x->parent = y.get();
-	if (y->left)
-		y->left->parent = x.get();
-
-	// Rotate left
-	x->right = std::move(y->left);
-	y->left = std::move(x);
-	x = std::move(y); // Put y where x was
-	x->left->update_height();
-	x->update_height();
-}
+	assert(std::all_of(seq_data.begin(), seq_data.end(), [&](auto i) {
+		return tree.search(2 * i) && !tree.search(2 * i + 1);
+	}));
+	bench.run("Seq  search", [&] {
+		for (auto i : seq_data)
+			do_not_optimize(tree.search(2 * i));
+	}, N);
+	bench.run("Seq !search", [&] {
+		for (auto i : seq_data)
+			do_not_optimize(tree.search(2 * i + 1));
+	}, N);
+
+	// Random data
+	//-------------------------------------------
+	auto rnd_data = gen_rand_ints(N);
+	IntTree rnd_tree;
+
+	for (auto i : rnd_data)
+		rnd_tree.insert(i);
+	bench.run("Rnd  insert", [&] {
+		IntTree t;
+		for (auto i : rnd_data)
+			t.insert(i);
+		do_not_optimize(t.get_root());
+	}, N);
 
-// Rotate right about X
-//       X            Y
-//     /  \          / \
-//    Y    a   =>   c   X
-//   / \               / \
-//  c   b             b   a
-void rotate_right(std::unique_ptr<Node> &x)
-{
-	assert(x->left);
-	auto y = std::move(x->left);
-
-	// Update backreferences
-	y->parent = x->parent;
-	x->parent = y.get();
-	if (y->right)
-		y->right->parent = x.get();
-
-	// Rotate right
-	x->left = std::move(y->right);
-	y->right = std::move(x);
-	x = std::move(y); // Put y where x was
-	x->right->update_height();
-	x->update_height();
-}
+	cout << "Balanced: "
+		 << (check_balanced(rnd_tree.get_root()) != UNBALANCED ? "YES" : "NO")
+		 << "\n";
 
-class AVLTree
-{
-public:
-	AVLTree() = default;
-
-	Node &insert(int val)
-	{
-		// If tree empty, then add root node
-		if (!tree) {
-			tree.reset(new Node(val));
-			return *tree;
-		}
-		return insert_impl(tree, val);
+	assert(std::all_of(rnd_data.begin(), rnd_data.end(), [&](auto i) {
+		return rnd_tree.search(i) != nullptr;
+	}));
+	bench.run("Rnd  search", [&] {
+		for (auto i : rnd_data)
+			do_not_optimize(rnd_tree.search(i));
+	}, N);
+
+	// Single searches, only the cycle counter is cheap enough for those
+	auto &tsc = TscClock::get();
+	std::vector<std::uint64_t> ticks(rnd_data.size());
+	for (std::size_t i = 0; i < rnd_data.size(); ++i) {
+		auto t0 = TscClock::start();
+		do_not_optimize(rnd_tree.search(rnd_data[i]));
+		ticks[i] = TscClock::stop() - t0;
 	}
+	auto mid = ticks.begin() + ticks.size() / 2;
+	std::nth_element(ticks.begin(), mid, ticks.end());
+	auto median_ticks = ticks.empty() ? 0 : *mid - std::min(*mid, tsc.overhead());
+	cout << "One  search: Time: " << tsc.to_ns(median_ticks) << "ns ("
+		 << median_ticks << " ticks, " << tsc.overhead() << " overhead"
+		 << (tsc.invariant() ? "" : ", TSC not invariant") << ")\n";
+
+	// Order statistics
+	auto median = rnd_tree.select(rnd_tree.size() / 2);
+	assert(rnd_tree.rank(median->key) <= rnd_tree.size() / 2);
+	cout << "Median: " << median->key << ", in [0, median]: "
+		 << rnd_tree.count_range(0, median->key) << "/" << rnd_tree.size()
+		 << "\n";
 
-	bool delete_key(int key);
-
-	Node *search(int val) { return search_impl(tree, val); }
-
-	Node *get_root() const { return tree.get(); }
-
-	void clear() { tree.reset(nullptr); }
-
-private:
-	std::unique_ptr<Node> tree;
-
-	static Node &insert_impl(std::unique_ptr<Node> &nd, int val);
-	Node *search_impl(std::unique_ptr<Node> &nd, int val);
-	/// Just balances the current node, use recursively from bottom to top
-	static void balance_node(std::unique_ptr<Node> &nd);
-};
-
-bool AVLTree::delete_key(int key)
-{
-	auto node = search(key);
-	if (node == nullptr)
-		return false;
+	// In-order walks
+	auto key_less = [](auto &a, auto &b) { return a.key < b.key; };
+	assert(std::is_sorted(rnd_tree.begin(), rnd_tree.end(), key_less));
+	std::size_t in_range = 0;
+	for (auto &nd : rnd_tree.range(0, median->key))
+		in_range += nd.key <= median->key;
+	assert(in_range == rnd_tree.count_range(0, median->key));
+	(void)key_less, (void)in_range;
+
+	auto frozen = rnd_tree.freeze();
+	assert(std::all_of(rnd_data.begin(), rnd_data.end(), [&](auto i) {
+		return frozen.search(i) && frozen.search(i)->key == i;
+	}));
+	bench.run("Frz  search", [&] {
+		for (auto i : rnd_data)
+			do_not_optimize(frozen.search(i));
+	}, N);
+
+	// Delete every other key, duplicates may get deleted twice
+	timeit.start();
+	for (std::size_t i = 0; i < rnd_data.size(); i += 2)
+		rnd_tree.delete_key(rnd_data[i]);
+	timeit.end().print(cout, "Rnd  delete");
 
-	// Get the unique pointer associated with the node,
-	// as search() returns a raw pointer.
+	cout << "Balanced: "
+		 << (check_balanced(rnd_tree.get_root()) != UNBALANCED ? "YES" : "NO")
+		 << "\n";
 
-	// 0 Children
-	if (node->left == nullptr && node->left == nullptr) {
-	}
-	// Left children exists
-	else if (node->left != nullptr) {
-	}
-	// Right children exists
-	else if (node->right != nullptr) {
-	}
-	// Both(left and right children exist)
-	else {
+	// Batched vs one by one lookups on a big tree
+	//-------------------------------------------
+	constexpr int BENCH_N = 1'000'000;
+	constexpr std::size_t BATCH = 64;
+	auto bench_data = gen_rand_ints(BENCH_N);
+	auto bench_keys = gen_rand_ints(BENCH_N);
+	std::vector<IntTree::Node *> found(BENCH_N);
+	IntTree bench_tree;
+	for (auto i : bench_data)
+		bench_tree.insert(i);
+	cout << "\nN = " << BENCH_N << ", seed " << bench_seed()
+		 << " (rerun with BENCH_SEED to repeat)\n";
+
+	// Lookups also show cache misses and branch misses per key
+	Timer hw_timer(true);
+	hw_timer.start();
+	for (std::size_t i = 0; i < bench_keys.size(); ++i)
+		found[i] = bench_tree.search(bench_keys[i]);
+	hw_timer.end().print(cout, "Big  search", BENCH_N);
+	auto found_scalar = std::count(found.begin(), found.end(), nullptr);
+
+	hw_timer.start();
+	for (std::size_t i = 0; i < bench_keys.size(); i += BATCH) {
+		auto n = std::min(BATCH, bench_keys.size() - i);
+		bench_tree.search_batch(
+			std::span(bench_keys).subspan(i, n), std::span(found).subspan(i, n)
+		);
 	}
+	hw_timer.end().print(cout, "Big  search_batch", BENCH_N);
+	assert(std::count(found.begin(), found.end(), nullptr) == found_scalar);
+	(void)found_scalar;
+#ifdef AVL_TREE_STATS
+	print_stats(cout, bench_tree.stats());
+#endif
+
+	// Bulk building and set operations, they need unique keys
+	//-------------------------------------------
+	auto sorted_keys = [](std::vector<int> v) {
+		std::sort(v.begin(), v.end());
+		v.erase(std::unique(v.begin(), v.end()), v.end());
+		return v;
+	};
+	auto set_a = sorted_keys(bench_data);
+	auto set_b = sorted_keys(bench_keys);
+	std::vector<int> expected;
 
-	return true;
-}
-
-Node &AVLTree::insert_impl(std::unique_ptr<Node> &nd, int val)
-{
-	assert(nd);
-	auto &ins = val < nd->key ? nd->left : nd->right;
-
-	if (ins) {
-		auto &ret = insert_impl(ins, val);
-		nd->update_height();
-		balance_node(nd);
-		return ret;
-	} else {
-		ins.reset(new Node(val));
-		ins->parent = nd.get();
-		nd->update_height();
-		balance_node(nd);
-		return *ins;
-	}
-}
+	timeit.start();
+	IntTree bulk_tree;
+	bulk_tree.build_from_sorted(set_a);
+	timeit.end().print(cout, "Big  build_from_sorted");
+	assert(bulk_tree.size() == set_a.size());
+
+	auto run_set_op = [&](auto op, const char *label) {
+		IntTree a, b;
+		a.build_from_sorted(set_a);
+		b.build_from_sorted(set_b);
+		timeit.start();
+		(a.*op)(std::move(b));
+		timeit.end().print(cout, label);
+		return a.size();
+	};
+	auto union_size = run_set_op(&IntTree::set_union, "Big  set_union");
+	auto inter_size =
+		run_set_op(&IntTree::set_intersection, "Big  set_intersection");
+	auto diff_size = run_set_op(&IntTree::set_difference, "Big  set_difference");
+
+	std::set_union(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(),
+				   std::back_inserter(expected));
+	assert(union_size == expected.size());
+	expected.clear();
+	std::set_intersection(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(),
+						  std::back_inserter(expected));
+	assert(inter_size == expected.size());
+	expected.clear();
+	std::set_difference(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(),
+						std::back_inserter(expected));
+	assert(diff_size == expected.size());
+	(void)union_size, (void)inter_size, (void)diff_size;
+
+	// Index based nodes, less than half the memory per key
+	//-------------------------------------------
+	CompactAVLTree<int> compact_tree;
+	timeit.start();
+	for (auto i : bench_data)
+		compact_tree.insert(i);
+	timeit.end().print(cout, "Cmp  insert");
+
+	hw_timer.start();
+	std::size_t compact_found = 0;
+	for (auto i : bench_keys)
+		compact_found += compact_tree.search(i) != nullptr;
+	hw_timer.end().print(cout, "Cmp  search", BENCH_N);
+	assert(compact_found == BENCH_N - std::size_t(found_scalar));
+	cout << "Found: " << compact_found << "/" << BENCH_N << ", bytes per key: "
+		 << sizeof(IntTree::Node) << " vs "
+		 << sizeof(CompactAVLTree<int>::Node) << " compact ("
+		 << compact_tree.memory_usage() / compact_tree.size() << " with slack)\n";
+
+	// Same keys in a B+-tree, a few cache lines per level instead of one
+	// line per key compared
+	//-------------------------------------------
+	BPlusTree<int> bplus_tree;
+	timeit.start();
+	for (auto i : bench_data)
+		bplus_tree.insert(i);
+	timeit.end().print(cout, "B+   insert");
+
+	hw_timer.start();
+	std::size_t bplus_found = 0;
+	for (auto i : bench_keys)
+		bplus_found += bplus_tree.search(i) != nullptr;
+	hw_timer.end().print(cout, "B+   search", BENCH_N);
+	cout << "Found: " << bplus_found << "/" << BENCH_N << "\n";
+	assert(bplus_found == compact_found);
+	assert(std::is_sorted(bplus_tree.begin(), bplus_tree.end(), key_less));
 
-Node *AVLTree::search_impl(std::unique_ptr<Node> &node, int val)
-{
-	if (!node)
-		return nullptr;
-	if (node->key == val)
-		return node.get();
-	return search_impl(val < node->key ? node->left : node->right, val);
-}
+	timeit.start();
+	for (std::size_t i = 0; i < bench_data.size(); i += 2)
+		bplus_tree.delete_key(bench_data[i]);
+	timeit.end().print(cout, "B+   delete");
 
-void AVLTree::balance_node(std::unique_ptr<Node> &nd)
-{
+	// Saved tree searched straight from the mapped file
+	//-------------------------------------------
+	auto snap_path = std::filesystem::temp_directory_path() / "avl_tree.snap";
+	timeit.start();
+	bench_tree.save(snap_path);
+	timeit.end().print(cout, "Map  save");
 
-	if (std::abs(nd->balance_factor()) <= 1)
-		return;
-
-	// Four cases total
-	// Left side unbalanced
-	if (nd->balance_factor() > 0) {
-		//       a**
-		//      /
-		//     b*
-		//    /
-		//   c
-		if (nd->left->balance_factor() > 0) {
-			rotate_right(nd);
-		}
-		//       a**
-		//      /
-		//     b*
-		//      \
-		//       c
-		else {
-			rotate_left(nd->left);
-			rotate_right(nd);
-		}
+	timeit.start();
+	auto mapped = IntTree::open_mapped(snap_path);
+	timeit.end().print(cout, "Map  open");
+
+	hw_timer.start();
+	std::size_t mapped_found = 0;
+	for (auto i : bench_keys)
+		mapped_found += mapped.search(i) != nullptr;
+	hw_timer.end().print(cout, "Map  search", BENCH_N);
+	assert(mapped_found == compact_found);
+	(void)mapped_found;
+	std::filesystem::remove(snap_path);
+
+	// Key distributions other than uniform, searched with the inserted keys
+	//-------------------------------------------
+	std::pair<const char *, std::vector<int>> workloads[] = {
+		{"Zipf", gen_zipf_ints(BENCH_N, 1'000'000, 0.99, true)},
+		{"Runs", gen_sorted_runs(BENCH_N, 1'000)},
+		{"Dups", gen_dup_ints(BENCH_N, 1'000)},
+		{"Rev ", gen_rev_ints(0, BENCH_N)},
+	};
+	for (auto &[name, keys] : workloads) {
+		IntTree wl_tree;
+		timeit.start();
+		for (auto i : keys)
+			wl_tree.insert(i);
+		timeit.end().print(cout, std::string(name) + " insert");
+		assert(wl_tree.size() == keys.size());
+
+		std::size_t wl_found = 0;
+		timeit.start();
+		for (auto i : keys)
+			wl_found += wl_tree.search(i) != nullptr;
+		timeit.end().print(cout, std::string(name) + " search", BENCH_N);
+		assert(wl_found == keys.size());
+		(void)wl_found;
 	}
-	// Right side unbalanced
-	else {
-		//       a**
-		//        \
-		//        b*
-		//         \
-		//          c
-		if (nd->right->balance_factor() < 0) {
-			rotate_left(nd);
-		}
-		//       a**
-		//        \
-		//         b*
-		//        /
-		//       c
-		else {
-			rotate_right(nd->right);
-			rotate_left(nd);
+
+	// Lock-free readers on a persistent tree while one thread writes
+	//-------------------------------------------
+	PersistentAVLTree<int> ptree;
+	for (auto i : bench_data)
+		ptree.insert(i);
+
+	// Thread counts double from 1, the last step is always every core
+	unsigned max_threads = std::max(1U, std::thread::hardware_concurrency());
+	auto next_threads = [&](unsigned n) {
+		return n < max_threads ? std::min(2 * n, max_threads) : n + 1;
+	};
+	for (unsigned nthreads = 1; nthreads <= max_threads;
+		 nthreads = next_threads(nthreads)) {
+		std::atomic<bool> stop = false;
+		std::atomic<std::size_t> total_hits = 0;
+		// Every insert is undone right away, so all rounds search the same
+		// keys while the writer keeps publishing new versions
+		std::thread writer([&] {
+			for (std::size_t i = 0; !stop; i = (i + 1) % bench_keys.size()) {
+				ptree.insert(bench_keys[i]);
+				ptree.delete_key(bench_keys[i]);
+			}
+		});
+
+		std::vector<std::thread> readers;
+		timeit.start();
+		for (unsigned t = 0; t < nthreads; ++t) {
+			readers.emplace_back([&] {
+				std::size_t hits = 0;
+				for (std::size_t i = 0; i < bench_keys.size(); i += BATCH) {
+					auto snap = ptree.snapshot();
+					auto end = std::min(i + BATCH, bench_keys.size());
+					for (std::size_t j = i; j < end; ++j)
+						hits += snap.search(bench_keys[j]) != nullptr;
+				}
+				total_hits += hits;
+			});
 		}
+		for (auto &r : readers)
+			r.join();
+		timeit.end().print(
+			cout, "Pst  search, readers: " + std::to_string(nthreads)
+		);
+		assert(total_hits > 0);
+
+		stop = true;
+		writer.join();
 	}
-}
-
-constexpr int UNBALANCED = -3;
-
-int check_balanced(Node *node)
-{
-	if (node == nullptr)
-		return -1;
-
-	int left = check_balanced(node->left.get());
-	int right = check_balanced(node->right.get());
-
-	if (left == UNBALANCED || right == UNBALANCED)
-		return -10;
-
-	int bf = left - right;
-	bf = bf > 0 ? bf : -bf;
-	if (bf > 1)
-		return UNBALANCED;
 
-	return (left > right ? left : right) + 1;
-}
-
-int main()
-{
-	constexpr int N = 64;
-	AVLTree tree;
-	Timer timeit;
-
-	// ***** Testing *****
-	// Sequential data
+	// Concurrent tree, every thread inserts its own range of the keys
+	// and then searches for them, throughput should scale with threads.
 	//-------------------------------------------
-	auto seq_data = gen_seq_ints(0, N);
-	cout << "N = " << seq_data.size() << "\n";
-
-	timeit.start();
-	for (auto i : seq_data)
-		tree.insert(i * 2); // Insert even numbers only.
-	timeit.end().print(cout, "Seq  insert");
-
-	// Confirm if balanced
-	cout << "Balanced: "
-		 << (check_balanced(tree.get_root()) != UNBALANCED ? "YES" : "NO")
-		 << "\n";
+	auto sorted_data = bench_data;
+	std::sort(sorted_data.begin(), sorted_data.end());
+	for (unsigned nthreads = 1; nthreads <= max_threads;
+		 nthreads = next_threads(nthreads)) {
+		// Thread t gets the keys of the t-th slice of the sorted keys, in
+		// their random order, equal keys always land in the same slice
+		std::vector<std::vector<int>> shares(nthreads);
+		for (auto key : bench_data) {
+			std::size_t rank = std::lower_bound(
+				sorted_data.begin(), sorted_data.end(), key
+			) - sorted_data.begin();
+			shares[rank * nthreads / sorted_data.size()].push_back(key);
+		}
 
-	timeit.start();
-	for (auto i : seq_data)
-		assert(tree.search(2 * i));
-	timeit.end().print(cout, "Seq  search");
+		ConcurrentAVLTree<int> ctree;
+		auto threads = std::to_string(nthreads);
+		auto run_workers = [&](auto work) {
+			std::vector<std::thread> workers;
+			for (unsigned t = 0; t < nthreads; ++t)
+				workers.emplace_back(work, t);
+			for (auto &w : workers)
+				w.join();
+		};
+
+		timeit.start();
+		run_workers([&](unsigned t) {
+			for (auto key : shares[t])
+				ctree.insert(key);
+		});
+		timeit.end().print(cout, "Cnc  insert, threads: " + threads);
+
+		std::atomic<std::size_t> total_hits = 0;
+		timeit.start();
+		run_workers([&](unsigned t) {
+			std::size_t hits = 0;
+			for (auto key : shares[t])
+				hits += ctree.contains(key);
+			total_hits += hits;
+		});
+		timeit.end().print(cout, "Cnc  search, threads: " + threads);
+		assert(total_hits == bench_data.size());
+	}
 
-	timeit.start();
-	for (auto i : seq_data)
-		assert(!tree.search(2 * i + 1));
-	timeit.end().print(cout, "Seq !search");
+	// Keys with payload and heterogeneous lookup,
+	// searching with a string_view does not build a std::string.
+	//-------------------------------------------
+	AVLTree<std::string, int, std::less<>> names;
+	names.insert("alpha", 1);
+	names.insert("beta", 2);
+	names.insert("gamma", 3);
+	std::string_view beta = "beta";
+	assert(names.search(beta) && names.search(beta)->value == 2);
+	bool deleted = names.delete_key(beta);
+	assert(deleted && !names.search(beta));
+	(void)deleted;
 
 	cout << "\n";
 	print_node(cout, tree.get_root());
+
+	bench.report();
 }
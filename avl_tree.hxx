@@ -0,0 +1,1691 @@
+#ifndef PROJECTS_SILLY_AVL_TREE_H
+#define PROJECTS_SILLY_AVL_TREE_H
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Build with -DAVL_TREE_STATS to make AVLTree count what its hot paths do,
+// without it the counting code is not compiled at all.
+#ifdef AVL_TREE_STATS
+#define AVL_STAT(...) __VA_ARGS__
+#else
+#define AVL_STAT(...)
+#endif
+
+// What AVLTree::stats() reports, all zero without AVL_TREE_STATS
+struct AVLTreeStats {
+	static constexpr std::size_t MAX_DEPTH = 64;
+
+	std::uint64_t searches = 0;
+	std::uint64_t search_comparisons = 0; // Nodes compared with the key
+	std::uint64_t inserts = 0;
+	std::uint64_t insert_retrace_steps = 0; // Ancestors visited after inserts
+	std::uint64_t erases = 0;
+	std::uint64_t erase_retrace_steps = 0;
+	std::uint64_t single_rotations = 0;
+	std::uint64_t double_rotations = 0;
+	// Not a counter: nodes at each depth (root at 0), taken by stats() from
+	// the current shape, as every rotation moves whole subtrees
+	std::array<std::uint64_t, MAX_DEPTH> depth_snapshot{};
+};
+
+// Key and the optional payload, a set (Value = void) stores just the key
+template <typename Key, typename Value>
+struct AVLNodeData {
+	Key key;
+	Value value;
+};
+
+template <typename Key>
+struct AVLNodeData<Key, void> {
+	Key key;
+};
+
+// Data comes first so that an int set node has no padding:
+// int key, int height, the subtree size and three pointers, 40 bytes.
+template <typename Key, typename Value = void>
+struct AVLNode : AVLNodeData<Key, Value> {
+	template <typename... Args>
+	explicit AVLNode(Args &&...data)
+		: AVLNodeData<Key, Value>{std::forward<Args>(data)...}
+	{
+	}
+
+	int balance_factor() const
+	{
+		auto l = left ? left->height : -1;
+		auto r = right ? right->height : -1;
+		return l - r;
+	}
+
+	/// Also recomputes the subtree size, children must be up to date
+	void update_height()
+	{
+		height =
+			std::max(left ? left->height : -1, right ? right->height : -1) + 1;
+		size = 1 + (left ? left->size : 0) + (right ? right->size : 0);
+	}
+
+	int height = 0;
+	std::size_t size = 1; // Number of nodes in this subtree
+	AVLNode *left = nullptr;
+	AVLNode *right = nullptr;
+	AVLNode *parent = nullptr;
+};
+
+// Slab allocator for tree nodes.
+// Nodes are carved out of fixed size chunks by bumping a pointer, freed nodes
+// are kept on an intrusive free list and handed out again before bumping.
+// reset() just rewinds the arena and keeps the chunks around for reuse,
+// so clearing a tree costs O(chunks). Live nodes are not destroyed by the
+// arena, that is up to the owner if the node type needs it.
+// Nodes allocated one after another are adjacent in memory, so subtrees
+// built together (which is the common case) share cache lines and pages.
+template <typename Node, typename Allocator = std::allocator<Node>>
+class NodeArena
+{
+	union Slot {
+		Slot *next;
+		alignas(Node) unsigned char raw[sizeof(Node)];
+	};
+
+	using SlotAlloc = typename std::allocator_traits<
+		Allocator>::template rebind_alloc<Slot>;
+	using SlotTraits = std::allocator_traits<SlotAlloc>;
+
+public:
+	explicit NodeArena(
+		std::size_t nodes_per_chunk = 1024, const Allocator &alloc = Allocator()
+	)
+		: slot_alloc(alloc)
+		, chunk_nodes(nodes_per_chunk)
+	{
+		assert(chunk_nodes > 0);
+	}
+
+	NodeArena(NodeArena &&other) noexcept
+		: slot_alloc(std::move(other.slot_alloc))
+		, chunk_nodes(other.chunk_nodes)
+		, chunks(std::move(other.chunks))
+		, cur_chunk(std::exchange(other.cur_chunk, 0))
+		, bump(std::exchange(other.bump, nullptr))
+		, bump_end(std::exchange(other.bump_end, nullptr))
+		, free_list(std::exchange(other.free_list, nullptr))
+	{
+		other.chunks.clear();
+	}
+
+	NodeArena &operator=(NodeArena &&other) noexcept
+	{
+		if (this != &other) {
+			release();
+			slot_alloc = std::move(other.slot_alloc);
+			chunk_nodes = other.chunk_nodes;
+			chunks = std::move(other.chunks);
+			other.chunks.clear();
+			cur_chunk = std::exchange(other.cur_chunk, 0);
+			bump = std::exchange(other.bump, nullptr);
+			bump_end = std::exchange(other.bump_end, nullptr);
+			free_list = std::exchange(other.free_list, nullptr);
+		}
+		return *this;
+	}
+
+	~NodeArena() { release(); }
+
+	template <typename... Args>
+	Node *alloc(Args &&...args)
+	{
+		Slot *mem;
+		if (free_list) {
+			mem = free_list;
+			free_list = free_list->next;
+		} else {
+			if (bump == bump_end)
+				next_chunk();
+			mem = bump++;
+		}
+
+		try {
+			return ::new (static_cast<void *>(mem))
+				Node(std::forward<Args>(args)...);
+		} catch (...) {
+			mem->next = free_list;
+			free_list = mem;
+			throw;
+		}
+	}
+
+	void free(Node *nd)
+	{
+		std::destroy_at(nd);
+		push_free(reinterpret_cast<Slot *>(nd));
+	}
+
+	/// Takes over all chunks of another arena with the same chunk size and
+	/// an equal allocator, its live nodes are ours from now on. Its unused
+	/// slots are put on our free list.
+	void adopt(NodeArena &&other)
+	{
+		assert(chunk_nodes == other.chunk_nodes);
+		for (auto slot = other.bump; slot != other.bump_end; ++slot)
+			push_free(slot);
+		while (auto slot = other.free_list) {
+			other.free_list = slot->next;
+			push_free(slot);
+		}
+
+		// Chunks in use go before our current chunk, spare ones after it
+		std::size_t used = other.bump ? other.cur_chunk + 1 : 0;
+		auto spare = other.chunks.begin() + used;
+		chunks.insert(chunks.end(), spare, other.chunks.end());
+		chunks.insert(chunks.begin(), other.chunks.begin(), spare);
+		if (bump) {
+			cur_chunk += used;
+		} else if (used) {
+			// No chunk of our own yet, continue as if the last one is full
+			cur_chunk = used - 1;
+			bump = bump_end = chunks[cur_chunk] + chunk_nodes;
+		}
+
+		other.chunks.clear();
+		other.reset();
+	}
+
+	/// Forget all nodes, chunks are retained for reuse.
+	void reset()
+	{
+		free_list = nullptr;
+		cur_chunk = 0;
+		bump = bump_end = nullptr;
+		if (!chunks.empty())
+			use_chunk(0);
+	}
+
+	/// Total number of node slots owned by the arena.
+	std::size_t capacity() const { return chunks.size() * chunk_nodes; }
+
+private:
+	void push_free(Slot *slot)
+	{
+		slot->next = free_list;
+		free_list = slot;
+	}
+
+	void use_chunk(std::size_t idx)
+	{
+		cur_chunk = idx;
+		bump = chunks[idx];
+		bump_end = bump + chunk_nodes;
+	}
+
+	void next_chunk()
+	{
+		auto idx = bump ? cur_chunk + 1 : 0;
+		if (idx == chunks.size()) {
+			chunks.reserve(chunks.size() + 1);
+			chunks.push_back(SlotTraits::allocate(slot_alloc, chunk_nodes));
+		}
+		use_chunk(idx);
+	}
+
+	void release()
+	{
+		for (auto chunk : chunks)
+			SlotTraits::deallocate(slot_alloc, chunk, chunk_nodes);
+		chunks.clear();
+		reset();
+	}
+
+	[[no_unique_address]] SlotAlloc slot_alloc;
+	std::size_t chunk_nodes;
+	std::vector<Slot *> chunks;
+	std::size_t cur_chunk = 0;
+	Slot *bump = nullptr;
+	Slot *bump_end = nullptr;
+	Slot *free_list = nullptr;
+};
+
+// Pretty printers :)
+//-------------------------------------------------------------------
+template <typename Node>
+std::ostream &
+print_node_conn_line(std::ostream &os, const Node *parent, bool for_left)
+{
+	// UTF-8 is broken in C++ so use vector instead,
+	// because we need to print in reversed direction & only 2 distinct chars
+	std::vector<bool> bar_or_space; // vert-bar: true, space: false
+	while (auto sparent = parent->parent) {
+		bar_or_space.insert(bar_or_space.end(), 3, false); // 3 spaces
+		// If left node, then bar as right node is below left node
+		bar_or_space.push_back(sparent->left == parent);
+		parent = sparent;
+	}
+
+	std::for_each(
+		bar_or_space.crbegin(), bar_or_space.crend(),
+		[&os](bool bar) { os << (bar ? "│" : " "); }
+	);
+	os << (for_left ? "├───" : "└───");
+
+	return os;
+}
+
+template <typename Node>
+std::ostream &print_node(std::ostream &os, const Node *node)
+{
+
+	if (node) {
+		os << "[" << node->key << "](" << node->balance_factor() << ")\n";
+	} else {
+		os << "[]\n";
+		return os;
+	}
+	// If no child nodes
+	if (!node->left && !node->right)
+		return os;
+
+	print_node_conn_line(os, node, true);
+	print_node(os, node->left);
+	print_node_conn_line(os, node, false);
+	print_node(os, node->right);
+
+	return os;
+}
+
+inline std::ostream &print_stats(std::ostream &os, const AVLTreeStats &st)
+{
+	auto per = [](std::uint64_t n, std::uint64_t d) { return d ? double(n) / d : 0.0; };
+
+	os << "Searches: " << st.searches << ", comparisons per search: "
+	   << per(st.search_comparisons, st.searches) << "\n";
+	os << "Inserts: " << st.inserts << ", retrace steps per insert: "
+	   << per(st.insert_retrace_steps, st.inserts) << "\n";
+	os << "Erases: " << st.erases << ", retrace steps per erase: "
+	   << per(st.erase_retrace_steps, st.erases) << "\n";
+	os << "Rotations: " << st.single_rotations << " single, "
+	   << st.double_rotations << " double\n";
+
+	os << "Depths:";
+	for (std::size_t d = 0; d < st.depth_snapshot.size(); ++d) {
+		if (st.depth_snapshot[d])
+			os << " " << d << ":" << st.depth_snapshot[d];
+	}
+	os << "\n";
+
+	return os;
+}
+//-------------------------------------------------------------------
+
+// Rotate left about X
+/*     X                Y
+     /  \              / \
+    a    Y     =>     X   c
+        / \          / \
+       b   c        a  b */
+template <typename Node>
+void rotate_left(Node *&x)
+{
+	assert(x->right);
+	auto y = x->right;
+
+	// Update backreferences
+	y->parent = x->parent;
+	x->parent = y;
+	if (y->left)
+		y->left->parent = x;
+
+	// Rotate left
+	x->right = y->left;
+	y->left = x;
+	x = y; // Put y where x was
+	x->left->update_height();
+	x->update_height();
+}
+
+// Rotate right about X
+/*       X            Y
+       /  \          / \
+      Y    a   =>   c   X
+     / \               / \
+    c   b             b   a */
+template <typename Node>
+void rotate_right(Node *&x)
+{
+	assert(x->left);
+	auto y = x->left;
+
+	// Update backreferences
+	y->parent = x->parent;
+	x->parent = y;
+	if (y->right)
+		y->right->parent = x;
+
+	// Rotate right
+	x->left = y->right;
+	y->right = x;
+	x = y; // Put y where x was
+	x->right->update_height();
+	x->update_height();
+}
+
+/// Leftmost (smallest) node of a subtree
+template <typename Node>
+Node *leftmost_node(Node *nd)
+{
+	if (nd)
+		while (nd->left)
+			nd = nd->left;
+	return nd;
+}
+
+/// Rightmost (largest) node of a subtree
+template <typename Node>
+Node *rightmost_node(Node *nd)
+{
+	if (nd)
+		while (nd->right)
+			nd = nd->right;
+	return nd;
+}
+
+/// In-order successor through the parent links, no stack needed
+template <typename Node>
+Node *next_node(Node *nd)
+{
+	if (nd->right)
+		return leftmost_node(nd->right);
+	while (nd->parent && nd->parent->right == nd)
+		nd = nd->parent;
+	return nd->parent;
+}
+
+/// In-order predecessor, mirror of next_node()
+template <typename Node>
+Node *prev_node(Node *nd)
+{
+	if (nd->left)
+		return rightmost_node(nd->left);
+	while (nd->parent && nd->parent->left == nd)
+		nd = nd->parent;
+	return nd->parent;
+}
+
+// Immutable, read-only copy of an AVLTree built by AVLTree::freeze().
+// Entries are stored in one array in Eytzinger (BFS) order: children of
+// the k-th entry (1-based) are at 2k and 2k+1. The top levels of the tree
+// share a few cache lines and every descent touches the array from the
+// front, search is branchless apart from the loop condition and prefetches
+// the grandchildren's grandchildren four levels ahead.
+//
+// The array has no pointers, so save() writes it to a file as is and
+// open_mapped() maps such a file read-only and searches it in place, only
+// the pages a search touches are ever read. Files use the native byte order
+// and layout, Key and Value must be trivially copyable for them. Copies
+// share the (immutable) entries.
+template <typename Key, typename Value = void, typename Compare = std::less<Key>>
+class FrozenAVLTree
+{
+public:
+	using Entry = AVLNodeData<Key, Value>;
+
+	FrozenAVLTree() = default;
+
+	/// Builds from nodes (or entries) given in sorted order
+	template <typename NodePtr>
+	FrozenAVLTree(const std::vector<NodePtr> &sorted, const Compare &cmp)
+		: comp(cmp)
+	{
+		auto n = sorted.size();
+		std::vector<std::size_t> order(n + 1);
+		std::size_t rank = 0;
+		fill_order(order, 1, rank);
+
+		auto owned = std::make_shared<std::vector<Entry>>();
+		owned->reserve(n);
+		for (std::size_t k = 1; k <= n; ++k)
+			owned->push_back(static_cast<const Entry &>(*sorted[order[k]]));
+		entries = owned->data();
+		count = n;
+		storage = std::move(owned);
+	}
+
+	/// Same as AVLTree::search, but the result points into the snapshot.
+	/// With duplicate keys the first one in order is found.
+	const Entry *search(const Key &key) const { return search_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Entry *search(const K &key) const
+	{
+		return search_impl(key);
+	}
+
+	std::size_t size() const { return count; }
+
+	/// Writes the entries to a file for open_mapped(), throws std::system_error
+	void save(const std::filesystem::path &path) const;
+
+	/// Maps a file written by save(), throws std::system_error if it can't
+	/// be read and std::runtime_error if it was saved with another Entry type.
+	static FrozenAVLTree
+	open_mapped(const std::filesystem::path &path, const Compare &cmp = Compare());
+
+private:
+	// Entries start at ENTRIES_OFFSET, which keeps them aligned in a mapping
+	static constexpr char FILE_MAGIC[8] = "AVLFRZ1";
+	static constexpr std::size_t ENTRIES_OFFSET = 64;
+	struct FileHeader {
+		char magic[8];
+		std::uint32_t entry_size;
+		std::uint32_t entry_align;
+		std::uint64_t count;
+	};
+	static_assert(alignof(Entry) <= ENTRIES_OFFSET);
+
+	/// Sorted rank of each Eytzinger index, by in-order walk of the implicit tree
+	void fill_order(std::vector<std::size_t> &order, std::size_t k, std::size_t &rank)
+	{
+		if (k >= order.size())
+			return;
+		fill_order(order, 2 * k, rank);
+		order[k] = rank++;
+		fill_order(order, 2 * k + 1, rank);
+	}
+
+	template <typename K>
+	const Entry *search_impl(const K &key) const
+	{
+		auto n = count;
+		std::size_t k = 1;
+
+		while (k <= n) {
+			if (16 * k <= n)
+				__builtin_prefetch(&entries[16 * k - 1]);
+			k = 2 * k + static_cast<bool>(comp(entries[k - 1].key, key));
+		}
+		// Path ends with the right turns (1 bits) after the last left turn,
+		// taken at the lower bound, so strip them and that left turn.
+		k >>= std::countr_one(k) + 1;
+
+		if (k == 0 || comp(key, entries[k - 1].key))
+			return nullptr;
+		return &entries[k - 1];
+	}
+
+	std::shared_ptr<const void> storage; // Vector or mapping holding entries
+	const Entry *entries = nullptr;
+	std::size_t count = 0;
+	[[no_unique_address]] Compare comp;
+};
+
+template <typename Key, typename Value, typename Compare>
+void FrozenAVLTree<Key, Value, Compare>::save(const std::filesystem::path &path
+) const
+{
+	static_assert(std::is_trivially_copyable_v<Entry>);
+
+	FileHeader header{};
+	std::copy(std::begin(FILE_MAGIC), std::end(FILE_MAGIC), header.magic);
+	header.entry_size = sizeof(Entry);
+	header.entry_align = alignof(Entry);
+	header.count = count;
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	char padding[ENTRIES_OFFSET - sizeof(header)] = {};
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(padding, sizeof(padding));
+	out.write(reinterpret_cast<const char *>(entries), count * sizeof(Entry));
+	out.close();
+	if (!out)
+		throw std::system_error(errno, std::generic_category(), path.string());
+}
+
+template <typename Key, typename Value, typename Compare>
+auto FrozenAVLTree<Key, Value, Compare>::open_mapped(
+	const std::filesystem::path &path, const Compare &cmp
+) -> FrozenAVLTree
+{
+	static_assert(std::is_trivially_copyable_v<Entry>);
+	auto fail = [&] {
+		throw std::system_error(errno, std::generic_category(), path.string());
+	};
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		fail();
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		fail();
+	}
+
+	std::size_t len = st.st_size;
+	void *addr = nullptr;
+	if (len >= ENTRIES_OFFSET)
+		addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+	int saved_errno = errno;
+	close(fd); // The mapping stays valid
+	errno = saved_errno;
+	if (addr == MAP_FAILED)
+		fail();
+
+	FrozenAVLTree frozen;
+	frozen.comp = cmp;
+	if (addr)
+		frozen.storage.reset(addr, [len](const void *p) {
+			munmap(const_cast<void *>(p), len);
+		});
+
+	FileHeader header{};
+	if (addr)
+		std::memcpy(&header, addr, sizeof(header));
+	if (!addr || !std::equal(std::begin(FILE_MAGIC), std::end(FILE_MAGIC), header.magic) ||
+		header.entry_size != sizeof(Entry) || header.entry_align != alignof(Entry) ||
+		header.count > (len - ENTRIES_OFFSET) / sizeof(Entry))
+		throw std::runtime_error(path.string() + ": not a matching frozen tree");
+
+	frozen.entries = reinterpret_cast<const Entry *>(
+		static_cast<const char *>(addr) + ENTRIES_OFFSET
+	);
+	frozen.count = header.count;
+
+	return frozen;
+}
+
+// AVL tree set (Value = void) or map from Key to Value.
+// Compare is a strict weak ordering, if it declares is_transparent then
+// search() and delete_key() also accept anything comparable with a Key.
+// Allocator is rebound to allocate the node arena's chunks.
+template <
+	typename Key, typename Value = void, typename Compare = std::less<Key>,
+	typename Allocator = std::allocator<Key>>
+class AVLTree
+{
+public:
+	using Node = AVLNode<Key, Value>;
+	using Arena = NodeArena<
+		Node,
+		typename std::allocator_traits<Allocator>::template rebind_alloc<Node>>;
+
+	// In-order bidirectional iterator over the nodes. Steps go through the
+	// parent links, so iterating needs no stack and never allocates.
+	// Only erasing the node it points to invalidates an iterator.
+	class iterator
+	{
+	public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using value_type = Node;
+		using difference_type = std::ptrdiff_t;
+		using pointer = Node *;
+		using reference = Node &;
+
+		iterator() = default;
+
+		reference operator*() const { return *nd; }
+		pointer operator->() const { return nd; }
+
+		iterator &operator++()
+		{
+			nd = next_node(nd);
+			return *this;
+		}
+		iterator operator++(int)
+		{
+			auto old = *this;
+			++*this;
+			return old;
+		}
+
+		/// Decrementing end() gives the last node
+		iterator &operator--()
+		{
+			nd = nd ? prev_node(nd) : rightmost_node(owner->tree);
+			return *this;
+		}
+		iterator operator--(int)
+		{
+			auto old = *this;
+			--*this;
+			return old;
+		}
+
+		bool operator==(const iterator &other) const = default;
+
+	private:
+		friend class AVLTree;
+		iterator(const AVLTree *t, Node *n)
+			: owner(t)
+			, nd(n)
+		{
+		}
+
+		const AVLTree *owner = nullptr;
+		Node *nd = nullptr;
+	};
+
+	AVLTree() = default;
+	explicit AVLTree(Arena node_arena, const Compare &cmp = Compare())
+		: arena(std::move(node_arena))
+		, comp(cmp)
+	{
+	}
+
+	AVLTree(AVLTree &&other) noexcept
+		: arena(std::move(other.arena))
+		, comp(std::move(other.comp))
+		, tree(std::exchange(other.tree, nullptr))
+	{
+	}
+
+	AVLTree &operator=(AVLTree &&other) noexcept
+	{
+		if (this != &other) {
+			clear();
+			arena = std::move(other.arena);
+			comp = std::move(other.comp);
+			tree = std::exchange(other.tree, nullptr);
+		}
+		return *this;
+	}
+
+	~AVLTree() { clear(); }
+
+	/// Inserts a key, for maps the remaining arguments build the value.
+	/// Duplicate keys are allowed, they go right of the equal ones.
+	template <typename... Args>
+	Node &insert(Key key, Args &&...value);
+
+	bool delete_key(const Key &key) { return delete_key_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool delete_key(const K &key)
+	{
+		return delete_key_impl(key);
+	}
+
+	/// Unlinks a node of this tree and gives it back to the arena
+	void erase(Node *node);
+
+	Node *search(const Key &key) const { return search_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	Node *search(const K &key) const
+	{
+		return search_impl(key);
+	}
+
+	/// Looks up many keys at once, out[i] is set to what search(keys[i])
+	/// would return. Descents of BATCH_LANES keys advance in lockstep and
+	/// each next node is prefetched while the other lanes make progress,
+	/// so the cache misses of a batch overlap instead of adding up.
+	void search_batch(std::span<const Key> keys, std::span<Node *> out) const;
+
+	Node *get_root() const { return tree; }
+
+	std::size_t size() const { return tree ? tree->size : 0; }
+
+	iterator begin() const { return {this, leftmost_node(tree)}; }
+	iterator end() const { return {this, nullptr}; }
+
+	/// First node whose key is not less than the key
+	iterator lower_bound(const Key &key) const;
+	/// First node whose key is greater than the key
+	iterator upper_bound(const Key &key) const;
+
+	/// Nodes with keys in the closed range [lo, hi], in order
+	std::ranges::subrange<iterator> range(const Key &lo, const Key &hi) const
+	{
+		if (comp(hi, lo))
+			return {end(), end()};
+		return {lower_bound(lo), upper_bound(hi)};
+	}
+
+	/// Number of keys less than the key
+	std::size_t rank(const Key &key) const { return count_below<false>(key); }
+
+	/// The k-th smallest (from 0) node, nullptr if k >= size()
+	Node *select(std::size_t k) const;
+
+	/// Number of keys in the closed range [lo, hi]
+	std::size_t count_range(const Key &lo, const Key &hi) const
+	{
+		if (comp(hi, lo))
+			return 0;
+		return count_below<true>(hi) - count_below<false>(lo);
+	}
+
+	/// Copies the current keys (and values) into a read-optimized snapshot,
+	/// later changes to the tree do not affect it.
+	FrozenAVLTree<Key, Value, Compare> freeze() const
+	{
+		TRACE_ZONE("AVLTree::freeze");
+		std::vector<const Node *> sorted;
+		for (const Node *nd = leftmost_node(tree); nd; nd = next_node(nd))
+			sorted.push_back(nd);
+		return {sorted, comp};
+	}
+
+	/// Saves a frozen copy of the tree, see FrozenAVLTree::save()
+	void save(const std::filesystem::path &path) const { freeze().save(path); }
+
+	/// Searchable read-only view of a file written by save(), entries are
+	/// read from the file on demand instead of being loaded up front.
+	static FrozenAVLTree<Key, Value, Compare>
+	open_mapped(const std::filesystem::path &path, const Compare &cmp = Compare())
+	{
+		return FrozenAVLTree<Key, Value, Compare>::open_mapped(path, cmp);
+	}
+
+	/// Counters since construction or reset_stats(), see AVL_TREE_STATS.
+	/// The depth snapshot walks the whole tree, O(n).
+	AVLTreeStats stats() const;
+	void reset_stats() { AVL_STAT(counters = {}); }
+
+	// Bulk operations built on join and split, they take nodes from the
+	// other tree instead of copying keys and leave it empty. Both trees
+	// must use arenas with the same chunk size.
+	//-------------------------------------------------------------------
+	/// Appends a tree whose keys are all not less than ours
+	void join(AVLTree &&right);
+
+	// Set operations treat both trees as sets, so keys must be unique.
+	// The two halves of every split are processed in parallel down to
+	// PARALLEL_GRAIN nodes, on up to about twice as many threads as cores.
+	void set_union(AVLTree &&other) { bulk_op(std::move(other), &AVLTree::union_nodes); }
+	void set_intersection(AVLTree &&other)
+	{
+		bulk_op(std::move(other), &AVLTree::intersection_nodes);
+	}
+	void set_difference(AVLTree &&other)
+	{
+		bulk_op(std::move(other), &AVLTree::difference_nodes);
+	}
+
+	/// Replaces the contents with already sorted keys in O(n), the tree is
+	/// built perfectly balanced so no rotations are done.
+	void build_from_sorted(std::span<const Key> keys)
+	{
+		TRACE_ZONE("AVLTree::build_from_sorted");
+		clear();
+		tree = build_subtree(keys, nullptr);
+	}
+	//-------------------------------------------------------------------
+
+	/// Drops all nodes at once, the arena keeps its memory for reuse.
+	void clear()
+	{
+		if constexpr (!std::is_trivially_destructible_v<Node>)
+			destroy_nodes();
+		tree = nullptr;
+		arena.reset();
+	}
+
+private:
+	// Integer keys under the default ordering are compared directly, this
+	// keeps the search loop exactly as tight as the old int-only tree.
+	template <typename K>
+	static constexpr bool native_compare = std::is_integral_v<Key> &&
+		std::is_same_v<K, Key> &&
+		(std::is_same_v<Compare, std::less<Key>> ||
+		 std::is_same_v<Compare, std::less<>>);
+
+	static constexpr std::size_t BATCH_LANES = 16;
+	static constexpr std::size_t PARALLEL_GRAIN = 1 << 14;
+
+	// Nodes to be freed after a parallel bulk operation, roots of subtrees
+	using Dropped = std::vector<Node *>;
+	using BulkFn = Node *(AVLTree::*)(Node *, Node *, Dropped &, int) const;
+
+	Arena arena;
+	[[no_unique_address]] Compare comp;
+	Node *tree = nullptr;
+	// Plain counters, searches from several threads race on them
+	AVL_STAT(mutable AVLTreeStats counters;)
+
+	template <typename K>
+	Node *search_impl(const K &key) const;
+	template <typename K>
+	bool delete_key_impl(const K &key);
+	/// Number of keys less than (or equal to, if inclusive) the key
+	template <bool inclusive>
+	std::size_t count_below(const Key &key) const;
+
+	/// Returns the link (parent's child pointer or root) which holds the node
+	Node *&link_of(Node *nd);
+	/// Fixes heights from a new leaf upwards, stops at the first subtree
+	/// whose height stays the same or after the (at most one) rebalance.
+	void retrace_insert(Node *nd);
+	/// Fixes heights and rebalances from a node upwards after a removal
+	/// below it, past the first subtree whose height stays the same only
+	/// the sizes are updated.
+	void retrace_erase(Node *nd);
+	/// Just balances the current node, use from bottom to top.
+	/// Returns the number of rotations done.
+	static int balance_node(Node *&nd);
+	/// Counts the rotations done by balance_node()
+	void count_rotations([[maybe_unused]] int rotations)
+	{
+		AVL_STAT(counters.single_rotations += rotations == 1;)
+		AVL_STAT(counters.double_rotations += rotations == 2;)
+	}
+	/// Runs node destructors bottom up, without recursion
+	void destroy_nodes();
+	/// Gives all nodes of a detached subtree back to the arena
+	void free_subtree(Node *nd);
+
+	// Join based primitives. They work on detached subtrees (root's parent
+	// is nullptr), never allocate and only touch nodes of their arguments,
+	// so they can run in parallel on disjoint subtrees.
+	/// Joins l, mid and r where l < mid <= r, returns the new root
+	static Node *join_nodes(Node *l, Node *mid, Node *r);
+	/// Same as join_nodes, mid goes down the right spine of the taller l
+	static Node *join_right(Node *l, Node *mid, Node *r);
+	static Node *join_left(Node *l, Node *mid, Node *r);
+	/// Joins l < r without a middle node
+	static Node *join2(Node *l, Node *r);
+	/// Rebalances from nd up to the root, returns the root
+	static Node *rebalance_up(Node *nd);
+	/// Splits into keys less than, equal to (a single node) and greater than key
+	void split_nodes(Node *t, const Key &key, Node *&l, Node *&mid, Node *&r)
+		const;
+
+	void bulk_op(AVLTree &&other, BulkFn fn);
+	/// Runs both halves of a bulk operation, in parallel if worth it
+	template <typename Fn>
+	void fork_join(std::size_t work, int depth, Dropped &dropped, Fn &&fn) const;
+	Node *union_nodes(Node *t1, Node *t2, Dropped &dropped, int depth) const;
+	Node *intersection_nodes(Node *t1, Node *t2, Dropped &dropped, int depth)
+		const;
+	Node *difference_nodes(Node *t1, Node *t2, Dropped &dropped, int depth)
+		const;
+
+	Node *build_subtree(std::span<const Key> keys, Node *parent);
+};
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+template <typename K>
+auto AVLTree<Key, Value, Compare, Allocator>::search_impl(const K &key) const
+	-> Node *
+{
+	TRACE_ZONE("AVLTree::search");
+	auto nd = tree;
+	AVL_STAT(++counters.searches;)
+
+	if constexpr (native_compare<K>) {
+		while (nd && nd->key != key) {
+			AVL_STAT(++counters.search_comparisons;)
+			nd = key < nd->key ? nd->left : nd->right;
+		}
+	} else {
+		while (nd) {
+			if (comp(key, nd->key))
+				nd = nd->left;
+			else if (comp(nd->key, key))
+				nd = nd->right;
+			else
+				break;
+			AVL_STAT(++counters.search_comparisons;)
+		}
+	}
+	// The node found was compared too
+	AVL_STAT(counters.search_comparisons += nd != nullptr;)
+
+	return nd;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::search_batch(
+	std::span<const Key> keys, std::span<Node *> out
+) const
+{
+	TRACE_ZONE("AVLTree::search_batch");
+	assert(out.size() >= keys.size());
+
+	AVL_STAT(counters.searches += keys.size();)
+	for (std::size_t base = 0; base < keys.size(); base += BATCH_LANES) {
+		auto lanes = std::min(BATCH_LANES, keys.size() - base);
+		auto lane_keys = keys.data() + base;
+		Node *cur[BATCH_LANES];
+		std::fill_n(cur, lanes, tree);
+
+		// One level per round for every unfinished lane
+		bool pending = true;
+		while (pending) {
+			pending = false;
+			for (std::size_t i = 0; i < lanes; ++i) {
+				auto nd = cur[i];
+				if (!nd)
+					continue;
+
+				auto &key = lane_keys[i];
+				if constexpr (native_compare<Key>) {
+					if (nd->key == key)
+						continue;
+					nd = key < nd->key ? nd->left : nd->right;
+				} else {
+					if (comp(key, nd->key))
+						nd = nd->left;
+					else if (comp(nd->key, key))
+						nd = nd->right;
+					else
+						continue;
+				}
+
+				AVL_STAT(++counters.search_comparisons;)
+				if (nd)
+					__builtin_prefetch(nd);
+				cur[i] = nd;
+				pending = true;
+			}
+		}
+
+		// Found lanes are compared again every round, count them once,
+		// as search_impl() does
+		AVL_STAT(for (std::size_t i = 0; i < lanes; ++i)
+			counters.search_comparisons += cur[i] != nullptr;)
+		std::copy_n(cur, lanes, out.data() + base);
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+template <typename... Args>
+auto AVLTree<Key, Value, Compare, Allocator>::insert(Key key, Args &&...value)
+	-> Node &
+{
+	TRACE_ZONE("AVLTree::insert");
+	// Allocate first, so that sizes can be bumped on the way down
+	auto nd = arena.alloc(std::move(key), std::forward<Args>(value)...);
+	Node *parent = nullptr;
+	Node **link = &tree;
+
+	while (*link) {
+		parent = *link;
+		++parent->size;
+		link = comp(nd->key, parent->key) ? &parent->left : &parent->right;
+	}
+
+	nd->parent = parent;
+	*link = nd;
+	AVL_STAT(++counters.inserts;)
+	retrace_insert(nd);
+
+	return *nd;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+template <typename K>
+bool AVLTree<Key, Value, Compare, Allocator>::delete_key_impl(const K &key)
+{
+	TRACE_ZONE("AVLTree::delete_key");
+	auto node = search_impl(key);
+	if (node == nullptr)
+		return false;
+
+	erase(node);
+	return true;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::erase(Node *node)
+{
+	// Lowest node whose subtree lost height, retracing starts from it
+	Node *retrace_from;
+
+	// At most one child, it just takes the node's place
+	if (node->left == nullptr || node->right == nullptr) {
+		auto child = node->left ? node->left : node->right;
+		if (child)
+			child->parent = node->parent;
+		link_of(node) = child;
+		retrace_from = node->parent;
+	}
+	// Both children exist, replace node with its in-order successor.
+	// Nodes are relinked and not copied so pointers to them stay valid.
+	else {
+		auto succ = node->right;
+		while (succ->left)
+			succ = succ->left;
+
+		if (succ->parent == node) {
+			retrace_from = succ;
+		} else {
+			retrace_from = succ->parent;
+			succ->parent->left = succ->right;
+			if (succ->right)
+				succ->right->parent = succ->parent;
+			succ->right = node->right;
+			succ->right->parent = succ;
+		}
+
+		succ->left = node->left;
+		succ->left->parent = succ;
+		succ->parent = node->parent;
+		succ->height = node->height;
+		succ->size = node->size;
+		link_of(node) = succ;
+	}
+
+	arena.free(node);
+	retrace_erase(retrace_from);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+template <bool inclusive>
+std::size_t AVLTree<Key, Value, Compare, Allocator>::count_below(const Key &key
+) const
+{
+	std::size_t count = 0;
+	auto nd = tree;
+
+	while (nd) {
+		bool below = inclusive ? !comp(key, nd->key) : comp(nd->key, key);
+		if (below) {
+			count += (nd->left ? nd->left->size : 0) + 1;
+			nd = nd->right;
+		} else {
+			nd = nd->left;
+		}
+	}
+
+	return count;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::lower_bound(const Key &key) const
+	-> iterator
+{
+	Node *bound = nullptr;
+	auto nd = tree;
+
+	while (nd) {
+		if (comp(nd->key, key)) {
+			nd = nd->right;
+		} else {
+			bound = nd;
+			nd = nd->left;
+		}
+	}
+
+	return {this, bound};
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::upper_bound(const Key &key) const
+	-> iterator
+{
+	Node *bound = nullptr;
+	auto nd = tree;
+
+	while (nd) {
+		if (comp(key, nd->key)) {
+			bound = nd;
+			nd = nd->left;
+		} else {
+			nd = nd->right;
+		}
+	}
+
+	return {this, bound};
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::select(std::size_t k) const
+	-> Node *
+{
+	auto nd = tree;
+
+	while (nd) {
+		auto left_size = nd->left ? nd->left->size : 0;
+		if (k < left_size) {
+			nd = nd->left;
+		} else if (k == left_size) {
+			return nd;
+		} else {
+			k -= left_size + 1;
+			nd = nd->right;
+		}
+	}
+
+	return nullptr;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+AVLTreeStats AVLTree<Key, Value, Compare, Allocator>::stats() const
+{
+	AVLTreeStats st;
+#ifdef AVL_TREE_STATS
+	st = counters;
+	// Recursion is bounded by the height
+	auto walk = [&](auto &self, const Node *nd, std::size_t depth) -> void {
+		if (!nd)
+			return;
+		++st.depth_snapshot[std::min(depth, st.depth_snapshot.size() - 1)];
+		self(self, nd->left, depth + 1);
+		self(self, nd->right, depth + 1);
+	};
+	walk(walk, tree, 0);
+#endif
+	return st;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::link_of(Node *nd) -> Node *&
+{
+	auto parent = nd->parent;
+	if (!parent)
+		return tree;
+	return parent->left == nd ? parent->left : parent->right;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::retrace_insert(Node *nd)
+{
+	for (auto p = nd->parent; p; p = p->parent) {
+		AVL_STAT(++counters.insert_retrace_steps;)
+		auto old_height = p->height;
+		p->update_height();
+
+		// A rotation after insert restores the subtree's old height,
+		// so nothing above it can change.
+		if (std::abs(p->balance_factor()) > 1) {
+			count_rotations(balance_node(link_of(p)));
+			return;
+		}
+		if (p->height == old_height)
+			return;
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::retrace_erase(Node *nd)
+{
+	AVL_STAT(++counters.erases;)
+	while (nd) {
+		AVL_STAT(++counters.erase_retrace_steps;)
+		auto old_height = nd->height;
+		nd->update_height();
+
+		if (std::abs(nd->balance_factor()) > 1) {
+			auto &link = link_of(nd);
+			count_rotations(balance_node(link));
+			nd = link;
+		}
+		if (nd->height == old_height)
+			break;
+		nd = nd->parent;
+	}
+
+	// Heights above are unchanged, but every ancestor lost one node
+	for (nd = nd ? nd->parent : nullptr; nd; nd = nd->parent)
+		--nd->size;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+int AVLTree<Key, Value, Compare, Allocator>::balance_node(Node *&nd)
+{
+
+	if (std::abs(nd->balance_factor()) <= 1)
+		return 0;
+
+	// Four cases total
+	// Left side unbalanced
+	if (nd->balance_factor() > 0) {
+		//       a**
+		//      /
+		//     b*
+		//    /
+		//   c
+		// Child can also be balanced after an erase, single rotation works
+		if (nd->left->balance_factor() >= 0) {
+			rotate_right(nd);
+			return 1;
+		}
+		/*       a**
+		        /
+		       b*
+		        \
+		         c */
+		else {
+			rotate_left(nd->left);
+			rotate_right(nd);
+			return 2;
+		}
+	}
+	// Right side unbalanced
+	else {
+		/*       a**
+		          \
+		          b*
+		           \
+		            c */
+		if (nd->right->balance_factor() <= 0) {
+			rotate_left(nd);
+			return 1;
+		}
+		/*       a**
+		          \
+		           b*
+		          /
+		         c */
+		else {
+			rotate_right(nd->right);
+			rotate_left(nd);
+			return 2;
+		}
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::destroy_nodes()
+{
+	auto nd = tree;
+	while (nd) {
+		if (nd->left) {
+			nd = nd->left;
+		} else if (nd->right) {
+			nd = nd->right;
+		} else {
+			auto parent = nd->parent;
+			if (parent)
+				(parent->left == nd ? parent->left : parent->right) = nullptr;
+			std::destroy_at(nd);
+			nd = parent;
+		}
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::free_subtree(Node *nd)
+{
+	while (nd) {
+		if (nd->left) {
+			nd = nd->left;
+		} else if (nd->right) {
+			nd = nd->right;
+		} else {
+			auto parent = nd->parent;
+			if (parent)
+				(parent->left == nd ? parent->left : parent->right) = nullptr;
+			arena.free(nd);
+			nd = parent;
+		}
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::join(AVLTree &&right)
+{
+	TRACE_ZONE("AVLTree::join");
+	assert(!tree || !right.tree ||
+		   !comp(leftmost_node(right.tree)->key, rightmost_node(tree)->key));
+
+	arena.adopt(std::move(right.arena));
+	tree = join2(tree, std::exchange(right.tree, nullptr));
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::join_nodes(
+	Node *l, Node *mid, Node *r
+) -> Node *
+{
+	auto hl = l ? l->height : -1;
+	auto hr = r ? r->height : -1;
+	if (hl > hr + 1)
+		return join_right(l, mid, r);
+	if (hr > hl + 1)
+		return join_left(l, mid, r);
+
+	mid->parent = nullptr;
+	mid->left = l;
+	mid->right = r;
+	if (l)
+		l->parent = mid;
+	if (r)
+		r->parent = mid;
+	mid->update_height();
+
+	return mid;
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::join_right(
+	Node *l, Node *mid, Node *r
+) -> Node *
+{
+	auto hr = r ? r->height : -1;
+	Node *p = nullptr;
+	auto c = l;
+
+	// First node on the right spine which is not too tall for r
+	while (c && c->height > hr + 1) {
+		p = c;
+		c = c->right;
+	}
+
+	mid->left = c;
+	mid->right = r;
+	if (c)
+		c->parent = mid;
+	if (r)
+		r->parent = mid;
+	mid->update_height();
+	p->right = mid;
+	mid->parent = p;
+
+	return rebalance_up(p);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::join_left(
+	Node *l, Node *mid, Node *r
+) -> Node *
+{
+	auto hl = l ? l->height : -1;
+	Node *p = nullptr;
+	auto c = r;
+
+	while (c && c->height > hl + 1) {
+		p = c;
+		c = c->left;
+	}
+
+	mid->left = l;
+	mid->right = c;
+	if (l)
+		l->parent = mid;
+	if (c)
+		c->parent = mid;
+	mid->update_height();
+	p->left = mid;
+	mid->parent = p;
+
+	return rebalance_up(p);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::rebalance_up(Node *nd) -> Node *
+{
+	while (true) {
+		nd->update_height();
+		auto parent = nd->parent;
+		if (!parent) {
+			balance_node(nd);
+			return nd;
+		}
+		balance_node(parent->left == nd ? parent->left : parent->right);
+		nd = parent;
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::join2(Node *l, Node *r) -> Node *
+{
+	if (!l)
+		return r;
+	if (!r)
+		return l;
+
+	// Take out the largest node of l and use it as the middle
+	auto last = rightmost_node(l);
+	auto p = last->parent;
+	auto child = last->left;
+	if (child)
+		child->parent = p;
+	if (p) {
+		p->right = child;
+		l = rebalance_up(p);
+	} else {
+		l = child;
+	}
+
+	return join_nodes(l, last, r);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::split_nodes(
+	Node *t, const Key &key, Node *&l, Node *&mid, Node *&r
+) const
+{
+	if (!t) {
+		l = mid = r = nullptr;
+		return;
+	}
+
+	auto tl = t->left;
+	auto tr = t->right;
+	if (tl)
+		tl->parent = nullptr;
+	if (tr)
+		tr->parent = nullptr;
+
+	if (comp(key, t->key)) {
+		Node *rest;
+		split_nodes(tl, key, l, mid, rest);
+		r = join_nodes(rest, t, tr);
+	} else if (comp(t->key, key)) {
+		Node *rest;
+		split_nodes(tr, key, rest, mid, r);
+		l = join_nodes(tl, t, rest);
+	} else {
+		l = tl;
+		r = tr;
+		mid = t;
+		mid->left = mid->right = mid->parent = nullptr;
+		mid->update_height();
+	}
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+void AVLTree<Key, Value, Compare, Allocator>::bulk_op(AVLTree &&other, BulkFn fn)
+{
+	TRACE_ZONE("AVLTree::set_op");
+	arena.adopt(std::move(other.arena));
+
+	// Each level of forking doubles the tasks, so this ends up with
+	// twice as many tasks as cores, which evens out unequal halves.
+	auto cores = std::max(1U, std::thread::hardware_concurrency());
+	int depth = std::bit_width(cores);
+
+	Dropped dropped;
+	tree = (this->*fn)(tree, std::exchange(other.tree, nullptr), dropped, depth);
+	for (auto nd : dropped)
+		free_subtree(nd);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+template <typename Fn>
+void AVLTree<Key, Value, Compare, Allocator>::fork_join(
+	std::size_t work, int depth, Dropped &dropped, Fn &&fn
+) const
+{
+	if (depth <= 0 || work < PARALLEL_GRAIN) {
+		fn(true, dropped, depth);
+		fn(false, dropped, depth);
+		return;
+	}
+
+	Dropped left_dropped;
+	auto left = std::async(std::launch::async, [&] {
+		TRACE_ZONE("AVLTree::set_op task");
+		fn(true, left_dropped, depth - 1);
+	});
+	fn(false, dropped, depth - 1);
+	left.get();
+	dropped.insert(dropped.end(), left_dropped.begin(), left_dropped.end());
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::union_nodes(
+	Node *t1, Node *t2, Dropped &dropped, int depth
+) const -> Node *
+{
+	if (!t1)
+		return t2;
+	if (!t2)
+		return t1;
+
+	auto work = t1->size + t2->size;
+	auto l1 = t1->left, r1 = t1->right;
+	if (l1)
+		l1->parent = nullptr;
+	if (r1)
+		r1->parent = nullptr;
+
+	Node *l2, *mid, *r2;
+	split_nodes(t2, t1->key, l2, mid, r2);
+	if (mid)
+		dropped.push_back(mid);
+
+	Node *l, *r;
+	fork_join(work, depth, dropped, [&](bool is_left, Dropped &d, int dep) {
+		if (is_left)
+			l = union_nodes(l1, l2, d, dep);
+		else
+			r = union_nodes(r1, r2, d, dep);
+	});
+
+	return join_nodes(l, t1, r);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::intersection_nodes(
+	Node *t1, Node *t2, Dropped &dropped, int depth
+) const -> Node *
+{
+	if (!t1 || !t2) {
+		dropped.push_back(t1 ? t1 : t2);
+		return nullptr;
+	}
+
+	auto work = t1->size + t2->size;
+	auto l1 = t1->left, r1 = t1->right;
+	if (l1)
+		l1->parent = nullptr;
+	if (r1)
+		r1->parent = nullptr;
+	t1->left = t1->right = nullptr;
+
+	Node *l2, *mid, *r2;
+	split_nodes(t2, t1->key, l2, mid, r2);
+
+	Node *l, *r;
+	fork_join(work, depth, dropped, [&](bool is_left, Dropped &d, int dep) {
+		if (is_left)
+			l = intersection_nodes(l1, l2, d, dep);
+		else
+			r = intersection_nodes(r1, r2, d, dep);
+	});
+
+	if (mid) {
+		dropped.push_back(mid);
+		return join_nodes(l, t1, r);
+	}
+	dropped.push_back(t1);
+	return join2(l, r);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::difference_nodes(
+	Node *t1, Node *t2, Dropped &dropped, int depth
+) const -> Node *
+{
+	if (!t1 || !t2) {
+		dropped.push_back(t2);
+		return t1;
+	}
+
+	auto work = t1->size + t2->size;
+	auto l2 = t2->left, r2 = t2->right;
+	if (l2)
+		l2->parent = nullptr;
+	if (r2)
+		r2->parent = nullptr;
+	t2->left = t2->right = nullptr;
+	dropped.push_back(t2);
+
+	Node *l1, *mid, *r1;
+	split_nodes(t1, t2->key, l1, mid, r1);
+	dropped.push_back(mid);
+
+	Node *l, *r;
+	fork_join(work, depth, dropped, [&](bool is_left, Dropped &d, int dep) {
+		if (is_left)
+			l = difference_nodes(l1, l2, d, dep);
+		else
+			r = difference_nodes(r1, r2, d, dep);
+	});
+
+	return join2(l, r);
+}
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+auto AVLTree<Key, Value, Compare, Allocator>::build_subtree(
+	std::span<const Key> keys, Node *parent
+) -> Node *
+{
+	if (keys.empty())
+		return nullptr;
+
+	// Parent is allocated right before its left subtree
+	auto mid = keys.size() / 2;
+	auto nd = arena.alloc(keys[mid]);
+	nd->parent = parent;
+	nd->left = build_subtree(keys.first(mid), nd);
+	nd->right = build_subtree(keys.subspan(mid + 1), nd);
+	nd->update_height();
+
+	return nd;
+}
+
+constexpr int UNBALANCED = -3;
+
+template <typename Node>
+int check_balanced(const Node *node)
+{
+	if (node == nullptr)
+		return -1;
+
+	int left = check_balanced(node->left);
+	int right = check_balanced(node->right);
+
+	if (left == UNBALANCED || right == UNBALANCED)
+		return UNBALANCED;
+
+	int bf = left - right;
+	bf = bf > 0 ? bf : -bf;
+	if (bf > 1)
+		return UNBALANCED;
+
+	return (left > right ? left : right) + 1;
+}
+
+#endif // End avl_tree.hxx
@@ -0,0 +1,632 @@
+#ifndef PROJECTS_SILLY_BPLUS_TREE_H
+#define PROJECTS_SILLY_BPLUS_TREE_H
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "avl_tree.hxx"
+
+// B+-tree with the same insert/search/delete_key/iteration interface as
+// AVLTree, for workloads where a binary tree wastes most of every cache
+// line it touches.
+//
+// Entries live only in the leaves, which are linked in order for
+// iteration. Inner nodes keep up to NODE_KEYS separators in a plain array
+// and leaves up to LEAF_ENTRIES entries, both 16 to 64 and sized to fill
+// whole cache lines. Within a node the position is found by counting the
+// keys below the one searched for: with AVX2 and 32 or 64-bit signed keys
+// under std::less that is a compare and movemask per 8 or 4 keys, no
+// branches at all. Other keys fall back to a binary search. For sets the
+// leaves hold bare keys and get the vector search too.
+//
+// Every insert or delete may move entries around, so pointers returned by
+// insert() and search() are only valid until the tree is changed.
+template <typename Key, typename Value = void, typename Compare = std::less<Key>>
+class BPlusTree
+{
+public:
+	using Entry = AVLNodeData<Key, Value>;
+
+	static constexpr std::uint32_t NODE_KEYS =
+		std::clamp<std::size_t>(256 / sizeof(Key), 16, 64);
+	static constexpr std::uint32_t LEAF_ENTRIES =
+		std::clamp<std::size_t>(256 / sizeof(Entry), 16, 64);
+
+private:
+	struct NodeBase {
+		std::uint32_t count = 0; // Keys in an inner node, entries in a leaf
+	};
+
+	struct alignas(64) Inner : NodeBase {
+		Key keys[NODE_KEYS]{};
+		NodeBase *children[NODE_KEYS + 1]{};
+	};
+
+	struct alignas(64) Leaf : NodeBase {
+		Leaf *prev = nullptr;
+		Leaf *next = nullptr;
+		Entry entries[LEAF_ENTRIES]{};
+	};
+
+public:
+	// In-order bidirectional iterator, walks the leaf chain
+	class iterator
+	{
+	public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using value_type = Entry;
+		using difference_type = std::ptrdiff_t;
+		using pointer = Entry *;
+		using reference = Entry &;
+
+		iterator() = default;
+
+		reference operator*() const { return leaf->entries[idx]; }
+		pointer operator->() const { return &leaf->entries[idx]; }
+
+		iterator &operator++()
+		{
+			if (++idx == leaf->count) {
+				leaf = leaf->next;
+				idx = 0;
+			}
+			return *this;
+		}
+		iterator operator++(int)
+		{
+			auto old = *this;
+			++*this;
+			return old;
+		}
+
+		/// Decrementing end() gives the last entry
+		iterator &operator--()
+		{
+			if (!leaf || idx == 0) {
+				leaf = leaf ? leaf->prev : owner->tail;
+				idx = leaf->count;
+			}
+			--idx;
+			return *this;
+		}
+		iterator operator--(int)
+		{
+			auto old = *this;
+			--*this;
+			return old;
+		}
+
+		bool operator==(const iterator &other) const = default;
+
+	private:
+		friend class BPlusTree;
+		iterator(const BPlusTree *t, Leaf *l, std::uint32_t i)
+			: owner(t)
+			, leaf(l)
+			, idx(i)
+		{
+		}
+
+		const BPlusTree *owner = nullptr;
+		Leaf *leaf = nullptr;
+		std::uint32_t idx = 0;
+	};
+
+	BPlusTree() = default;
+	explicit BPlusTree(const Compare &cmp)
+		: comp(cmp)
+	{
+	}
+
+	BPlusTree(BPlusTree &&other) noexcept
+		: inners(std::move(other.inners))
+		, leaves(std::move(other.leaves))
+		, comp(std::move(other.comp))
+		, root(std::exchange(other.root, nullptr))
+		, head(std::exchange(other.head, nullptr))
+		, tail(std::exchange(other.tail, nullptr))
+		, height(std::exchange(other.height, 0))
+		, entry_count(std::exchange(other.entry_count, 0))
+	{
+	}
+
+	BPlusTree &operator=(BPlusTree &&other) noexcept
+	{
+		if (this != &other) {
+			clear();
+			inners = std::move(other.inners);
+			leaves = std::move(other.leaves);
+			comp = std::move(other.comp);
+			root = std::exchange(other.root, nullptr);
+			head = std::exchange(other.head, nullptr);
+			tail = std::exchange(other.tail, nullptr);
+			height = std::exchange(other.height, 0);
+			entry_count = std::exchange(other.entry_count, 0);
+		}
+		return *this;
+	}
+
+	~BPlusTree() { clear(); }
+
+	/// Inserts a key, for maps the remaining arguments build the value.
+	/// Duplicate keys are allowed, they go after the equal ones.
+	template <typename... Args>
+	Entry &insert(Key key, Args &&...value);
+
+	bool delete_key(const Key &key) { return delete_key_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool delete_key(const K &key)
+	{
+		return delete_key_impl(key);
+	}
+
+	/// With duplicate keys the first one in order is found
+	Entry *search(const Key &key) const { return search_impl(key); }
+
+	template <typename K, typename C = Compare, typename = typename C::is_transparent>
+	Entry *search(const K &key) const
+	{
+		return search_impl(key);
+	}
+
+	std::size_t size() const { return entry_count; }
+
+	iterator begin() const { return {this, head, 0}; }
+	iterator end() const { return {this, nullptr, 0}; }
+
+	/// Drops all entries, the arenas keep their memory for reuse
+	void clear();
+
+private:
+	// Same fast path as AVLTree, keys the vector units can compare directly
+	template <typename K>
+	static constexpr bool simd_keys =
+#ifdef __AVX2__
+		std::is_signed_v<Key> && std::is_integral_v<Key> &&
+		(sizeof(Key) == 4 || sizeof(Key) == 8) && std::is_same_v<K, Key> &&
+		(std::is_same_v<Compare, std::less<Key>> ||
+		 std::is_same_v<Compare, std::less<>>);
+#else
+		false;
+#endif
+
+	static const Key &key_of(const Key &key) { return key; }
+	static const Key &key_of(const Entry &entry) { return entry.key; }
+
+	/// Number of the first n items with keys below (or equal to, if
+	/// inclusive) the key, i.e. where the key goes in a node
+	template <bool inclusive, typename Item, typename K>
+	std::uint32_t rank_in(const Item *items, std::uint32_t n, const K &key) const;
+
+	/// Fewest keys (or entries) a node of the level holds, the root aside
+	static constexpr std::uint32_t min_count(int level)
+	{
+		return level ? NODE_KEYS / 2 : LEAF_ENTRIES / 2;
+	}
+
+	struct Split {
+		Key sep{}; // Not greater than any key in right
+		NodeBase *right = nullptr;
+	};
+
+	Split insert_rec(NodeBase *nd, int level, Entry &&fresh, Entry *&placed);
+	Split insert_leaf(Leaf *leaf, Entry &&fresh, Entry *&placed);
+	template <typename K>
+	bool erase_rec(NodeBase *nd, int level, const K &key);
+	/// Refills child i of an inner node from a sibling, or merges them
+	void fix_underflow(Inner *parent, std::uint32_t i, int level);
+	void remove_child(Inner *parent, std::uint32_t i);
+
+	template <typename K>
+	Entry *search_impl(const K &key) const;
+	template <typename K>
+	bool delete_key_impl(const K &key);
+
+	void destroy_nodes(NodeBase *nd, int level);
+
+	NodeArena<Inner> inners;
+	NodeArena<Leaf> leaves;
+	[[no_unique_address]] Compare comp;
+	NodeBase *root = nullptr;
+	Leaf *head = nullptr;
+	Leaf *tail = nullptr;
+	int height = 0; // Levels of inner nodes above the leaves
+	std::size_t entry_count = 0;
+};
+
+template <typename Key, typename Value, typename Compare>
+template <bool inclusive, typename Item, typename K>
+std::uint32_t BPlusTree<Key, Value, Compare>::rank_in(
+	const Item *items, std::uint32_t n, const K &key
+) const
+{
+	if constexpr (simd_keys<K> && sizeof(Item) == sizeof(Key)) {
+#ifdef __AVX2__
+		// Compares all lanes of every vector and masks off those past n,
+		// nodes hold a multiple of the lane count so loads stay inside.
+		constexpr std::uint32_t LANES = 32 / sizeof(Key);
+		static_assert(NODE_KEYS % LANES == 0 && LEAF_ENTRIES % LANES == 0);
+		__m256i target;
+		if constexpr (sizeof(Key) == 4)
+			target = _mm256_set1_epi32(key);
+		else
+			target = _mm256_set1_epi64x(key);
+		std::uint32_t rank = 0;
+
+		for (std::uint32_t i = 0; i < n; i += LANES) {
+			auto keys = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i *>(&key_of(items[i]))
+			);
+			// keys < key, or with inclusive !(keys > key)
+			__m256i gt;
+			if constexpr (sizeof(Key) == 4)
+				gt = inclusive ? _mm256_cmpgt_epi32(keys, target)
+							   : _mm256_cmpgt_epi32(target, keys);
+			else
+				gt = inclusive ? _mm256_cmpgt_epi64(keys, target)
+							   : _mm256_cmpgt_epi64(target, keys);
+
+			unsigned bits = sizeof(Key) == 4
+				? _mm256_movemask_ps(_mm256_castsi256_ps(gt))
+				: _mm256_movemask_pd(_mm256_castsi256_pd(gt));
+			if (inclusive)
+				bits = ~bits & ((1U << LANES) - 1);
+			if (n - i < LANES)
+				bits &= (1U << (n - i)) - 1;
+			rank += std::popcount(bits);
+		}
+
+		return rank;
+#endif
+	} else {
+		auto below = std::partition_point(items, items + n, [&](const Item &item) {
+			return inclusive ? !comp(key, key_of(item)) : comp(key_of(item), key);
+		});
+		return static_cast<std::uint32_t>(below - items);
+	}
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename... Args>
+auto BPlusTree<Key, Value, Compare>::insert(Key key, Args &&...value) -> Entry &
+{
+	Entry fresh{std::move(key), std::forward<Args>(value)...};
+	Entry *placed = nullptr;
+
+	if (!root)
+		root = head = tail = leaves.alloc();
+
+	auto split = insert_rec(root, height, std::move(fresh), placed);
+	if (split.right) {
+		auto new_root = inners.alloc();
+		new_root->count = 1;
+		new_root->keys[0] = std::move(split.sep);
+		new_root->children[0] = root;
+		new_root->children[1] = split.right;
+		root = new_root;
+		++height;
+	}
+	++entry_count;
+
+	return *placed;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto BPlusTree<Key, Value, Compare>::insert_rec(
+	NodeBase *nd, int level, Entry &&fresh, Entry *&placed
+) -> Split
+{
+	if (level == 0)
+		return insert_leaf(static_cast<Leaf *>(nd), std::move(fresh), placed);
+
+	auto inner = static_cast<Inner *>(nd);
+	auto i = rank_in<true>(inner->keys, inner->count, fresh.key);
+	auto split = insert_rec(inner->children[i], level - 1, std::move(fresh), placed);
+	if (!split.right)
+		return {};
+
+	// Full, move the upper half out first and push the middle key up
+	Split up;
+	auto target = inner;
+	if (inner->count == NODE_KEYS) {
+		constexpr auto mid = NODE_KEYS / 2;
+		auto right = inners.alloc();
+		right->count = NODE_KEYS - mid - 1;
+		std::move(inner->keys + mid + 1, inner->keys + NODE_KEYS, right->keys);
+		std::copy(
+			inner->children + mid + 1, inner->children + NODE_KEYS + 1,
+			right->children
+		);
+		up = {std::move(inner->keys[mid]), right};
+		inner->count = mid;
+
+		if (i > mid) {
+			target = right;
+			i -= mid + 1;
+		}
+	}
+
+	std::move_backward(
+		target->keys + i, target->keys + target->count,
+		target->keys + target->count + 1
+	);
+	std::copy_backward(
+		target->children + i + 1, target->children + target->count + 1,
+		target->children + target->count + 2
+	);
+	target->keys[i] = std::move(split.sep);
+	target->children[i + 1] = split.right;
+	++target->count;
+
+	return up;
+}
+
+template <typename Key, typename Value, typename Compare>
+auto BPlusTree<Key, Value, Compare>::insert_leaf(
+	Leaf *leaf, Entry &&fresh, Entry *&placed
+) -> Split
+{
+	auto i = rank_in<true>(leaf->entries, leaf->count, fresh.key);
+
+	Split up;
+	auto target = leaf;
+	if (leaf->count == LEAF_ENTRIES) {
+		constexpr auto half = LEAF_ENTRIES / 2;
+		auto right = leaves.alloc();
+		right->count = LEAF_ENTRIES - half;
+		std::move(leaf->entries + half, leaf->entries + LEAF_ENTRIES, right->entries);
+		leaf->count = half;
+
+		right->prev = leaf;
+		right->next = leaf->next;
+		(leaf->next ? leaf->next->prev : tail) = right;
+		leaf->next = right;
+		up.right = right;
+
+		if (i > half) {
+			target = right;
+			i -= half;
+		}
+	}
+
+	std::move_backward(
+		target->entries + i, target->entries + target->count,
+		target->entries + target->count + 1
+	);
+	target->entries[i] = std::move(fresh);
+	++target->count;
+	placed = &target->entries[i];
+
+	if (up.right)
+		up.sep = static_cast<Leaf *>(up.right)->entries[0].key;
+	return up;
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+bool BPlusTree<Key, Value, Compare>::delete_key_impl(const K &key)
+{
+	if (!root || !erase_rec(root, height, key))
+		return false;
+	--entry_count;
+
+	// Shrink from the top, the root may have fewer entries than the rest
+	if (height > 0 && root->count == 0) {
+		auto old_root = static_cast<Inner *>(root);
+		root = old_root->children[0];
+		inners.free(old_root);
+		--height;
+	} else if (height == 0 && root->count == 0) {
+		leaves.free(static_cast<Leaf *>(root));
+		root = head = tail = nullptr;
+	}
+
+	return true;
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+bool BPlusTree<Key, Value, Compare>::erase_rec(NodeBase *nd, int level, const K &key)
+{
+	if (level == 0) {
+		auto leaf = static_cast<Leaf *>(nd);
+		auto i = rank_in<false>(leaf->entries, leaf->count, key);
+		if (i == leaf->count || comp(key, leaf->entries[i].key))
+			return false;
+
+		std::move(
+			leaf->entries + i + 1, leaf->entries + leaf->count, leaf->entries + i
+		);
+		--leaf->count;
+		return true;
+	}
+
+	// Keys equal to a separator can also start the child right of it
+	auto inner = static_cast<Inner *>(nd);
+	auto i = rank_in<false>(inner->keys, inner->count, key);
+	bool found = erase_rec(inner->children[i], level - 1, key);
+	if (!found && i < inner->count && !comp(key, inner->keys[i]))
+		found = erase_rec(inner->children[++i], level - 1, key);
+
+	if (found && inner->children[i]->count < min_count(level - 1))
+		fix_underflow(inner, i, level - 1);
+	return found;
+}
+
+template <typename Key, typename Value, typename Compare>
+void BPlusTree<Key, Value, Compare>::fix_underflow(
+	Inner *parent, std::uint32_t i, int level
+)
+{
+	auto min = min_count(level);
+	auto left_sib = i > 0 ? parent->children[i - 1] : nullptr;
+	auto right_sib = i < parent->count ? parent->children[i + 1] : nullptr;
+
+	if (level == 0) {
+		auto leaf = static_cast<Leaf *>(parent->children[i]);
+		auto left = static_cast<Leaf *>(left_sib);
+		auto right = static_cast<Leaf *>(right_sib);
+
+		if (left && left->count > min) {
+			std::move_backward(
+				leaf->entries, leaf->entries + leaf->count,
+				leaf->entries + leaf->count + 1
+			);
+			leaf->entries[0] = std::move(left->entries[--left->count]);
+			++leaf->count;
+			parent->keys[i - 1] = leaf->entries[0].key;
+		} else if (right && right->count > min) {
+			leaf->entries[leaf->count++] = std::move(right->entries[0]);
+			std::move(
+				right->entries + 1, right->entries + right->count, right->entries
+			);
+			--right->count;
+			parent->keys[i] = right->entries[0].key;
+		} else {
+			// Merge into the left one of the pair, the right one goes
+			if (left)
+				--i;
+			leaf = static_cast<Leaf *>(parent->children[i]);
+			right = static_cast<Leaf *>(parent->children[i + 1]);
+			std::move(
+				right->entries, right->entries + right->count,
+				leaf->entries + leaf->count
+			);
+			leaf->count += right->count;
+			leaf->next = right->next;
+			(right->next ? right->next->prev : tail) = leaf;
+			remove_child(parent, i);
+			leaves.free(right);
+		}
+		return;
+	}
+
+	auto inner = static_cast<Inner *>(parent->children[i]);
+	auto left = static_cast<Inner *>(left_sib);
+	auto right = static_cast<Inner *>(right_sib);
+
+	// Keys rotate through the separator in the parent
+	if (left && left->count > min) {
+		std::move_backward(
+			inner->keys, inner->keys + inner->count, inner->keys + inner->count + 1
+		);
+		std::copy_backward(
+			inner->children, inner->children + inner->count + 1,
+			inner->children + inner->count + 2
+		);
+		inner->keys[0] = std::move(parent->keys[i - 1]);
+		inner->children[0] = left->children[left->count];
+		++inner->count;
+		parent->keys[i - 1] = std::move(left->keys[--left->count]);
+	} else if (right && right->count > min) {
+		inner->keys[inner->count] = std::move(parent->keys[i]);
+		inner->children[++inner->count] = right->children[0];
+		parent->keys[i] = std::move(right->keys[0]);
+		std::move(right->keys + 1, right->keys + right->count, right->keys);
+		std::copy(
+			right->children + 1, right->children + right->count + 1,
+			right->children
+		);
+		--right->count;
+	} else {
+		if (left)
+			--i;
+		inner = static_cast<Inner *>(parent->children[i]);
+		right = static_cast<Inner *>(parent->children[i + 1]);
+		inner->keys[inner->count] = std::move(parent->keys[i]);
+		std::move(
+			right->keys, right->keys + right->count, inner->keys + inner->count + 1
+		);
+		std::copy(
+			right->children, right->children + right->count + 1,
+			inner->children + inner->count + 1
+		);
+		inner->count += right->count + 1;
+		remove_child(parent, i);
+		inners.free(right);
+	}
+}
+
+template <typename Key, typename Value, typename Compare>
+void BPlusTree<Key, Value, Compare>::remove_child(Inner *parent, std::uint32_t i)
+{
+	// Drops separator i and the child right of it
+	std::move(
+		parent->keys + i + 1, parent->keys + parent->count, parent->keys + i
+	);
+	std::copy(
+		parent->children + i + 2, parent->children + parent->count + 1,
+		parent->children + i + 1
+	);
+	--parent->count;
+}
+
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+auto BPlusTree<Key, Value, Compare>::search_impl(const K &key) const -> Entry *
+{
+	if (!root)
+		return nullptr;
+
+	auto nd = root;
+	for (int level = height; level > 0; --level) {
+		auto inner = static_cast<const Inner *>(nd);
+		nd = inner->children[rank_in<false>(inner->keys, inner->count, key)];
+	}
+
+	// The first equal key can also be first in the next leaf
+	auto leaf = static_cast<Leaf *>(nd);
+	auto i = rank_in<false>(leaf->entries, leaf->count, key);
+	if (i == leaf->count) {
+		leaf = leaf->next;
+		i = 0;
+	}
+
+	if (!leaf || comp(key, leaf->entries[i].key))
+		return nullptr;
+	return &leaf->entries[i];
+}
+
+template <typename Key, typename Value, typename Compare>
+void BPlusTree<Key, Value, Compare>::clear()
+{
+	if (root)
+		destroy_nodes(root, height);
+	inners.reset();
+	leaves.reset();
+	root = head = tail = nullptr;
+	height = 0;
+	entry_count = 0;
+}
+
+template <typename Key, typename Value, typename Compare>
+void BPlusTree<Key, Value, Compare>::destroy_nodes(NodeBase *nd, int level)
+{
+	// The arenas are reset afterwards, this is only for the destructors
+	if constexpr (!std::is_trivially_destructible_v<Inner> ||
+				  !std::is_trivially_destructible_v<Leaf>) {
+		if (level == 0) {
+			std::destroy_at(static_cast<Leaf *>(nd));
+			return;
+		}
+		auto inner = static_cast<Inner *>(nd);
+		for (std::uint32_t i = 0; i <= inner->count; ++i)
+			destroy_nodes(inner->children[i], level - 1);
+		std::destroy_at(inner);
+	} else {
+		(void)nd, (void)level;
+	}
+}
+
+#endif // End bplus_tree.hxx
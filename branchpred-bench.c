@@ -59,7 +59,7 @@ double bench_branch(unsigned int seed)
 	return percent;
 }
 
-int main(int argc, char const *argv[])
+int main(void)
 {
 	setlocale(LC_NUMERIC, "");
 	printf("Starting branch predition test...\nwith %d elements and %d iterations:\n\n",
@@ -76,7 +76,10 @@ int main(int argc, char const *argv[])
 	avg = avg / NITERS;
 /* Locale numeric comma flag is only supported on posix systems so... */
 #if __unix__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat" // The ' flag is POSIX, not ISO C
 	printf("INFO: %'d elements, %'d iterations\n", NELEMS, NITERS);
+#pragma GCC diagnostic pop
 #else
 	printf("INFO: %d elements, %d iterations\n", NELEMS, NITERS);
 #endif
@@ -36,6 +36,7 @@
  *
  * Compile command: gcc calculator.c -lm -o calculator
  * For GNU-readline support include flags: -DREADLINE_ENABLED -lreadline
+ * To trace parse and execute times include flag: -DTRACE_ENABLED
  */
 
 #include <assert.h>
@@ -47,6 +48,8 @@
 #include <stdbool.h>
 #include <setjmp.h>
 
+#include "trace.h"
+
 #ifdef READLINE_ENABLED
 #include <readline/readline.h>
 #else
@@ -227,11 +230,13 @@ static void op_negate(void) { stack[stack_top - 1] = -stack[stack_top - 1]; }
 
 static void execute_code(void)
 {
+	TRACE_ZONE("execute");
 	code_pc = 0;
 	stack_top = 0;
 
 	while (code_pc < code_cnt)
 		(*code[code_pc++].fnptr)();
+	TRACE_COUNTER("code_size", code_cnt);
 }
 
 // Parser
@@ -558,6 +563,7 @@ static void parse_expr(void)
 // Returns false on empty input, true if parsed successfully.
 static bool parse_input(void)
 {
+	TRACE_ZONE("parse");
 	param_cnt = 0;
 	code_cnt = 0;
 	cursor = 0;
@@ -1,27 +1,133 @@
 #ifndef PROJECTS_SILLY_GEN_BENCH_H
 #define PROJECTS_SILLY_GEN_BENCH_H
 
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 #include <random>
 #include <chrono>
 
-[[maybe_unused]] static auto
-gen_rand_ints(std::vector<int>::size_type n, int max = 1'000'000)
-	-> std::vector<int>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Workload generators.
+// Every element is a pure function of the seed and its index (splitmix64 of
+// a counter), so outputs are filled in parallel and come out the same for
+// a seed no matter how many threads did the work. Without an explicit seed
+// each call takes the next seed of the run, derived from bench_seed().
+//-------------------------------------------------------------------
+
+/// Seed of this run, BENCH_SEED from the environment or a random one.
+/// Print it, running again with BENCH_SEED set reproduces the data.
+[[maybe_unused]] static std::uint64_t bench_seed()
 {
-	std::mt19937 prng((std::random_device())());
-	std::uniform_int_distribution<int> dist(0, max);
-	std::vector<int> ret;
-	ret.reserve(n);
+	static const std::uint64_t seed = [] {
+		if (auto env = std::getenv("BENCH_SEED"))
+			return std::uint64_t(std::strtoull(env, nullptr, 0));
+		std::random_device rd;
+		return (std::uint64_t(rd()) << 32) | rd();
+	}();
+	return seed;
+}
+
+[[maybe_unused]] static std::uint64_t splitmix64(std::uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+/// Seeds for generator calls one after another, the same sequence per run
+[[maybe_unused]] static std::uint64_t next_seed()
+{
+	static std::atomic<std::uint64_t> calls = 0;
+	return splitmix64(bench_seed() ^ splitmix64(calls++));
+}
+
+// Number i of a random stream, with helpers to map it to a range
+struct CounterRng {
+	std::uint64_t seed;
+
+	std::uint64_t operator()(std::uint64_t i) const
+	{
+		return splitmix64(seed + i * 0x9e3779b97f4a7c15);
+	}
+	/// Uniform in [0, range), range below 2^32
+	std::uint32_t below(std::uint64_t i, std::uint64_t range) const
+	{
+		return std::uint32_t(((*this)(i) >> 32) * range >> 32);
+	}
+	/// Uniform in [0, 1)
+	double unit(std::uint64_t i) const { return ((*this)(i) >> 11) * 0x1p-53; }
+};
 
-	for (unsigned i = 0; i < n; ++i)
-		ret.push_back(dist(prng));
+/// Calls fn(begin, end) on parts of [0, n), on all cores if n is big enough
+template <typename Fn>
+static void parallel_for(std::size_t n, Fn &&fn)
+{
+	constexpr std::size_t GRAIN = 1 << 16;
+	std::size_t nthreads = std::min<std::size_t>(
+		std::max(1U, std::thread::hardware_concurrency()), n / GRAIN
+	);
+	if (nthreads <= 1) {
+		fn(std::size_t(0), n);
+		return;
+	}
 
+	std::vector<std::thread> threads;
+	for (std::size_t t = 1; t < nthreads; ++t)
+		threads.emplace_back(fn, n * t / nthreads, n * (t + 1) / nthreads);
+	fn(std::size_t(0), n / nthreads);
+	for (auto &th : threads)
+		th.join();
+}
+
+/// out[i] = gen(i) for all i, in parallel
+template <typename T, typename Gen>
+static std::vector<T> generate_parallel(std::size_t n, Gen &&gen)
+{
+	std::vector<T> ret(n);
+	parallel_for(n, [&](std::size_t begin, std::size_t end) {
+		for (auto i = begin; i < end; ++i)
+			ret[i] = gen(i);
+	});
 	return ret;
 }
 
+/// Uniform keys in [0, max]
+[[maybe_unused]] static auto gen_rand_ints(
+	std::vector<int>::size_type n, int max = 1'000'000,
+	std::uint64_t seed = next_seed()
+) -> std::vector<int>
+{
+	CounterRng rng{seed};
+	return generate_parallel<int>(n, [&](std::size_t i) {
+		return int(rng.below(i, std::uint64_t(max) + 1));
+	});
+}
+
 [[maybe_unused]] static auto gen_seq_ints(int start, int end)
 	-> std::vector<int>
 {
@@ -34,35 +140,565 @@ gen_rand_ints(std::vector<int>::size_type n, int max = 1'000'000)
 	return ret;
 }
 
+/// end - 1 down to start
+[[maybe_unused]] static auto gen_rev_ints(int start, int end)
+	-> std::vector<int>
+{
+	auto ret = gen_seq_ints(start, end);
+	std::reverse(ret.begin(), ret.end());
+	return ret;
+}
+
+/// Zipfian keys in [0, max], key k is drawn about 1 / (k + 1)^theta as
+/// often as key 0. theta in (0, 1), YCSB uses 0.99. Hot keys are the small
+/// ones, with scramble they are spread over the range by a hash instead.
+[[maybe_unused]] static auto gen_zipf_ints(
+	std::vector<int>::size_type n, int max = 1'000'000, double theta = 0.99,
+	bool scramble = false, std::uint64_t seed = next_seed()
+) -> std::vector<int>
+{
+	// Inverse CDF approximation from Gray et al., "Quickly Generating
+	// Billion-Record Synthetic Databases". zeta(items) is summed exactly
+	// for the first terms and integrated for the rest.
+	double items = double(max) + 1;
+	auto zeta = [theta](double count) {
+		constexpr double EXACT = 10'000;
+		double sum = 0;
+		for (double k = 1; k <= std::min(count, EXACT); ++k)
+			sum += std::pow(k, -theta);
+		if (count > EXACT)
+			sum += (std::pow(count + 0.5, 1 - theta) - std::pow(EXACT + 0.5, 1 - theta)) /
+				(1 - theta);
+		return sum;
+	};
+	double zetan = zeta(items);
+	double alpha = 1 / (1 - theta);
+	double eta = (1 - std::pow(2 / items, 1 - theta)) / (1 - zeta(2) / zetan);
+	double second = 1 + std::pow(0.5, theta);
+
+	CounterRng rng{seed};
+	return generate_parallel<int>(n, [&](std::size_t i) {
+		double u = rng.unit(i);
+		double uz = u * zetan;
+		std::uint64_t rank = uz < 1 ? 0
+			: uz < second          ? 1
+								   : std::uint64_t(items * std::pow(eta * u - eta + 1, alpha));
+		rank = std::min<std::uint64_t>(rank, max);
+		if (scramble)
+			rank = splitmix64(rank ^ seed) % (std::uint64_t(max) + 1);
+		return int(rank);
+	});
+}
+
+/// Ascending runs of run_len uniform keys in [0, max], each run sorted on
+/// its own. A noise fraction of the keys is then replaced by random ones.
+[[maybe_unused]] static auto gen_sorted_runs(
+	std::vector<int>::size_type n, std::size_t run_len, double noise = 0.01,
+	int max = 1'000'000, std::uint64_t seed = next_seed()
+) -> std::vector<int>
+{
+	auto ret = gen_rand_ints(n, max, seed);
+	CounterRng rng{splitmix64(seed)};
+	std::size_t runs = (n + run_len - 1) / run_len;
+
+	parallel_for(runs, [&](std::size_t begin, std::size_t end) {
+		for (auto r = begin; r < end; ++r) {
+			auto first = ret.begin() + r * run_len;
+			std::sort(first, first + std::min(run_len, n - r * run_len));
+		}
+	});
+	parallel_for(n, [&](std::size_t begin, std::size_t end) {
+		for (auto i = begin; i < end; ++i) {
+			if (rng.unit(2 * i) < noise)
+				ret[i] = int(rng.below(2 * i + 1, std::uint64_t(max) + 1));
+		}
+	});
+
+	return ret;
+}
+
+/// Uniform keys out of only distinct different ones, spread over [0, max]
+[[maybe_unused]] static auto gen_dup_ints(
+	std::vector<int>::size_type n, std::size_t distinct, int max = 1'000'000,
+	std::uint64_t seed = next_seed()
+) -> std::vector<int>
+{
+	CounterRng rng{seed};
+	auto step = (std::uint64_t(max) + 1) / std::max<std::size_t>(distinct, 1);
+	return generate_parallel<int>(n, [&](std::size_t i) {
+		return int(rng.below(i, distinct) * std::max<std::uint64_t>(step, 1));
+	});
+}
+//-------------------------------------------------------------------
+
+// Hardware counters of this thread, opened as one perf_event_open group
+// so that they all count over exactly the same code. Events the CPU or
+// kernel don't support are left out. If none can be opened (not Linux,
+// perf_event_paranoid too strict, no PMU in a VM) available() is false and
+// all counts read as zero, so callers need no special cases.
+class PerfCounters
+{
+public:
+	enum Event { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, NUM_EVENTS };
+	static constexpr const char *NAMES[NUM_EVENTS] = {
+		"cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses"};
+	using Counts = std::array<double, NUM_EVENTS>;
+
+	PerfCounters();
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters &operator=(const PerfCounters &) = delete;
+	~PerfCounters();
+
+	bool available() const { return leader != -1; }
+	bool has(Event ev) const { return fds[ev] != -1; }
+
+	void start();
+	/// Counts since start(), scaled up if the kernel had to multiplex them
+	Counts stop();
+
+private:
+	std::array<int, NUM_EVENTS> fds;
+	int leader = -1;
+};
+
+inline PerfCounters::PerfCounters()
+{
+	fds.fill(-1);
+#ifdef __linux__
+	auto cache_miss = [](std::uint64_t cache) {
+		return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	};
+	const std::pair<std::uint32_t, std::uint64_t> events[NUM_EVENTS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		{PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)},
+		{PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)},
+	};
+
+	for (int ev = 0; ev < NUM_EVENTS; ++ev) {
+		perf_event_attr attr{};
+		attr.size = sizeof(attr);
+		attr.type = events[ev].first;
+		attr.config = events[ev].second;
+		attr.disabled = leader == -1; // The leader starts and stops the group
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		if (fd == -1)
+			continue;
+		fds[ev] = fd;
+		if (leader == -1)
+			leader = fd;
+	}
+#endif
+}
+
+inline PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+	for (auto fd : fds) {
+		if (fd != -1)
+			close(fd);
+	}
+#endif
+}
+
+inline void PerfCounters::start()
+{
+#ifdef __linux__
+	if (leader == -1)
+		return;
+	ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+inline auto PerfCounters::stop() -> Counts
+{
+	Counts counts{};
+#ifdef __linux__
+	if (leader == -1)
+		return counts;
+	ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	// Number of events, time enabled, time running, then the values in
+	// the order the events were opened
+	std::uint64_t buf[3 + NUM_EVENTS];
+	if (read(leader, buf, sizeof(buf)) < 24 || buf[2] == 0)
+		return counts;
+	double scale = double(buf[1]) / buf[2];
+	std::size_t idx = 3;
+	for (int ev = 0; ev < NUM_EVENTS; ++ev) {
+		if (fds[ev] != -1 && idx < 3 + buf[0])
+			counts[ev] = buf[idx++] * scale;
+	}
+#endif
+	return counts;
+}
+
+// Cycle counter clock for timing short stretches of code, like a single
+// tree search, where steady_clock's own cost would swamp the result.
+// Reading it is a few instructions: rdtsc on x86, the virtual counter on
+// aarch64 and steady_clock (in ns) elsewhere. The first get() measures
+// the tick rate against CLOCK_MONOTONIC_RAW, which takes CALIBRATION_TIME.
+//
+//     auto t0 = TscClock::start();
+//     work();
+//     auto ns = TscClock::get().to_ns(TscClock::stop() - t0);
+class TscClock
+{
+public:
+	static constexpr std::chrono::milliseconds CALIBRATION_TIME{10};
+
+	static const TscClock &get()
+	{
+		static const TscClock clock;
+		return clock;
+	}
+
+	/// Ticks before the timed code, it can't start before this is read
+	static std::uint64_t start()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		_mm_lfence();
+		auto t = __rdtsc();
+		_mm_lfence();
+		return t;
+#else
+		return now();
+#endif
+	}
+
+	/// Ticks after the timed code, read once it has finished
+	static std::uint64_t stop()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		unsigned aux;
+		auto t = __rdtscp(&aux);
+		_mm_lfence();
+		return t;
+#else
+		return now();
+#endif
+	}
+
+	/// Ticks without any ordering, for timestamps rather than intervals
+	static std::uint64_t now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#elif defined(__aarch64__)
+		std::uint64_t t;
+		asm volatile("isb; mrs %0, cntvct_el0" : "=r"(t));
+		return t;
+#else
+		auto t = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+#endif
+	}
+
+	double to_ns(std::uint64_t ticks) const { return ticks * ns_per_tick; }
+	double ticks_per_ns() const { return 1 / ns_per_tick; }
+
+	/// Ticks measured for an empty start()/stop() pair, the least a
+	/// measurement can show
+	std::uint64_t overhead() const { return min_overhead; }
+
+	/// Whether the counter runs at a constant rate through frequency and
+	/// power state changes, without that ticks are not a measure of time
+	bool invariant() const { return is_invariant; }
+
+private:
+	TscClock();
+
+	static std::uint64_t raw_ns()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		return std::uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+	}
+
+	double ns_per_tick = 1;
+	std::uint64_t min_overhead = 0;
+	bool is_invariant = true;
+};
+
+inline TscClock::TscClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+	is_invariant = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+		(edx & (1U << 8));
+#endif
+
+	// Both clocks read back to back, the tick count taken in the middle
+	auto sample = [](std::uint64_t &ns, std::uint64_t &ticks) {
+		auto t0 = now();
+		ns = raw_ns();
+		ticks = t0 + (now() - t0) / 2;
+	};
+
+	std::uint64_t ns0, ticks0, ns1, ticks1;
+	sample(ns0, ticks0);
+	auto end_ns = ns0 + std::chrono::nanoseconds(CALIBRATION_TIME).count();
+	do {
+		sample(ns1, ticks1);
+	} while (ns1 < end_ns);
+	ns_per_tick = double(ns1 - ns0) / (ticks1 - ticks0);
+
+	min_overhead = ~std::uint64_t(0);
+	for (int i = 0; i < 1000; ++i) {
+		auto t0 = start();
+		min_overhead = std::min(min_overhead, stop() - t0);
+	}
+}
+
 class Timer
 {
 public:
 	Timer() = default;
+	/// With hw_counters the time between start() and end() also gets
+	/// PerfCounters, which print() shows when they are available.
+	explicit Timer(bool hw_counters)
+	{
+		if (hw_counters)
+			counters = std::make_unique<PerfCounters>();
+	}
+
 	Timer &start()
 	{
+		if (counters)
+			counters->start();
 		tbeg = std::chrono::steady_clock::now();
 		return *this;
 	}
 	Timer &end()
 	{
 		tend = std::chrono::steady_clock::now();
+		if (counters)
+			counts = counters->stop();
 		return *this;
 	}
 
-	void print(std::ostream &oss, std::string_view msg = "Task")
+	/// Counts of the last start()/end(), zero without counters
+	const PerfCounters::Counts &counts_taken() const { return counts; }
+
+	/// With items > 0 the counters are also shown per item
+	void print(std::ostream &oss, std::string_view msg = "Task", std::size_t items = 0)
 	{
 		std::chrono::duration<double> t = (tend - tbeg);
 		oss << msg << ": Time: " << t.count() << "s\n";
+		print_counters(oss, items);
 	}
 	void print_nano(std::ostream &oss, std::string_view msg = "Task")
 	{
 		std::chrono::nanoseconds t = (tend - tbeg);
 		oss << msg << ": Time: " << t.count() << "ns\n";
+		print_counters(oss, 0);
 	}
 
 private:
+	void print_counters(std::ostream &oss, std::size_t items)
+	{
+		if (!counters || !counters->available())
+			return;
+
+		oss << "   ";
+		for (int ev = 0; ev < PerfCounters::NUM_EVENTS; ++ev) {
+			if (!counters->has(PerfCounters::Event(ev)))
+				continue;
+			oss << " " << PerfCounters::NAMES[ev] << ": ";
+			if (items)
+				oss << counts[ev] / items << "/item";
+			else
+				oss << counts[ev];
+		}
+		if (counters->has(PerfCounters::CYCLES) && counts[PerfCounters::CYCLES] > 0 &&
+			counters->has(PerfCounters::INSTRUCTIONS))
+			oss << " IPC: "
+				<< counts[PerfCounters::INSTRUCTIONS] / counts[PerfCounters::CYCLES];
+		oss << "\n";
+	}
+
 	std::chrono::time_point<std::chrono::steady_clock> tbeg;
 	std::chrono::time_point<std::chrono::steady_clock> tend;
+	std::unique_ptr<PerfCounters> counters;
+	PerfCounters::Counts counts{};
 };
 
+/// Makes the compiler assume the value is read, so the work that produced
+/// it can't be optimized out of a benchmark.
+template <typename T>
+inline void do_not_optimize(const T &value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/// Makes the compiler assume all memory is read and written here
+inline void clobber_memory()
+{
+	asm volatile("" : : : "memory");
+}
+
+// Times of one benchmark, all per call of the benchmarked function
+struct BenchResult {
+	std::string name;
+	std::size_t items;      // Elements processed per call, for per item rates
+	std::size_t iterations; // Calls per sample
+	std::size_t samples;
+	double median_ns;
+	double mean_ns;
+	double stddev_ns;
+	double min_ns;
+	double max_ns; // Slowest sample, too few samples for a p99
+};
+
+struct BenchOptions {
+	std::chrono::nanoseconds warmup = std::chrono::milliseconds(20);
+	std::chrono::nanoseconds sample_time = std::chrono::milliseconds(2);
+	std::size_t samples = 50;
+};
+
+// Statistical microbenchmark runner.
+// Each benchmark is warmed up first, which also estimates how long a call
+// takes. Calls are then timed in samples of enough iterations to take about
+// sample_time each, so clock overhead and resolution don't matter, and the
+// samples are summarized. Results are printed as they come and can also be
+// written as JSON or CSV for tracking them over time.
+class Bench
+{
+public:
+	Bench() = default;
+	explicit Bench(const BenchOptions &options)
+		: opts(options)
+	{
+	}
+	/// Takes --json=<path> and --csv=<path> from the command line for
+	/// report(), other arguments are left for the program.
+	Bench(int argc, char *argv[], const BenchOptions &options = {})
+		: opts(options)
+	{
+		for (int i = 1; i < argc; ++i) {
+			std::string_view arg = argv[i];
+			if (arg.starts_with("--json="))
+				json_path = arg.substr(7);
+			else if (arg.starts_with("--csv="))
+				csv_path = arg.substr(6);
+		}
+	}
+
+	/// Benchmarks fn(), which handles items elements per call
+	template <typename Fn>
+	const BenchResult &run(std::string_view name, Fn &&fn, std::size_t items = 1);
+
+	const std::vector<BenchResult> &results() const { return all; }
+
+	void write_json(std::ostream &os) const;
+	void write_csv(std::ostream &os) const;
+	/// Writes the files asked for on the command line
+	void report() const;
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	BenchOptions opts;
+	std::string json_path;
+	std::string csv_path;
+	std::vector<BenchResult> all;
+};
+
+template <typename Fn>
+const BenchResult &Bench::run(std::string_view name, Fn &&fn, std::size_t items)
+{
+	// Warm up caches, branch predictors and the CPU clock
+	std::size_t warmup_calls = 0;
+	auto warmup_end = clock::now() + opts.warmup;
+	auto tbeg = clock::now();
+	do {
+		fn();
+		++warmup_calls;
+	} while (clock::now() < warmup_end);
+	auto per_call =
+		std::chrono::duration<double, std::nano>(clock::now() - tbeg) / warmup_calls;
+
+	std::size_t iters = std::max(1.0, opts.sample_time / per_call);
+	std::vector<double> times;
+	times.reserve(opts.samples);
+	for (std::size_t s = 0; s < opts.samples; ++s) {
+		auto start = clock::now();
+		for (std::size_t i = 0; i < iters; ++i)
+			fn();
+		std::chrono::duration<double, std::nano> t = clock::now() - start;
+		times.push_back(t.count() / iters);
+	}
+
+	double sum = 0;
+	for (auto t : times)
+		sum += t;
+	double mean = sum / times.size();
+	double var = 0;
+	for (auto t : times)
+		var += (t - mean) * (t - mean);
+
+	std::sort(times.begin(), times.end());
+	auto at = [&](double q) {
+		return times[std::min(times.size() - 1, std::size_t(q * times.size()))];
+	};
+	auto &res = all.emplace_back(BenchResult{
+		std::string(name), items, iters, times.size(), at(0.5), mean,
+		times.size() > 1 ? std::sqrt(var / (times.size() - 1)) : 0.0,
+		times.front(), times.back()});
+
+	std::cout << res.name << ": Time: " << res.median_ns << "ns (mean "
+			  << res.mean_ns << " +- " << res.stddev_ns << ", max " << res.max_ns;
+	if (items > 1)
+		std::cout << ", " << res.median_ns / items << "ns/item";
+	std::cout << ")\n";
+
+	return res;
+}
+
+inline void Bench::write_json(std::ostream &os) const
+{
+	os << "[\n";
+	for (std::size_t i = 0; i < all.size(); ++i) {
+		auto &r = all[i];
+		// Names are our own labels, nothing in them needs escaping
+		os << "  {\"name\": \"" << r.name << "\", \"items\": " << r.items
+		   << ", \"iterations\": " << r.iterations << ", \"samples\": " << r.samples
+		   << ", \"median_ns\": " << r.median_ns << ", \"mean_ns\": " << r.mean_ns
+		   << ", \"stddev_ns\": " << r.stddev_ns << ", \"min_ns\": " << r.min_ns
+		   << ", \"max_ns\": " << r.max_ns << "}"
+		   << (i + 1 < all.size() ? ",\n" : "\n");
+	}
+	os << "]\n";
+}
+
+inline void Bench::write_csv(std::ostream &os) const
+{
+	os << "name,items,iterations,samples,median_ns,mean_ns,stddev_ns,min_ns,max_ns\n";
+	for (auto &r : all) {
+		os << r.name << "," << r.items << "," << r.iterations << "," << r.samples
+		   << "," << r.median_ns << "," << r.mean_ns << "," << r.stddev_ns << ","
+		   << r.min_ns << "," << r.max_ns << "\n";
+	}
+}
+
+inline void Bench::report() const
+{
+	if (!json_path.empty()) {
+		std::ofstream out(json_path);
+		write_json(out);
+	}
+	if (!csv_path.empty()) {
+		std::ofstream out(csv_path);
+		write_csv(out);
+	}
+}
+
 #endif // End gen_bench.hxx
\ No newline at end of file
@@ -0,0 +1,211 @@
+/**
+ * @file revserver-bench.c
+ * @brief Load generator for revserver, prints completed requests per second
+ *
+ * Usage: revserver-bench [-c clients] [-d seconds] [-p port] [-i idle]
+ * Each client is a thread that keeps opening a connection, sending a line
+ * and reading the reply until the server's time stamp arrives. So this
+ * measures accepts as much as it measures reads and writes.
+ *
+ * -i opens that many more connections first, which stay silent during the
+ * run, and checks afterwards that every one of them still gets an answer.
+ * Both processes need an fd limit above that number.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+static struct sockaddr_in server_addr;
+static struct timespec deadline;
+
+enum {
+	IDLE_PER_ADDR = 20000, /* Below the ephemeral port range of one address */
+};
+
+typedef struct client_stats {
+	pthread_t thread;
+	unsigned long requests;
+	unsigned long failures;
+} client_stats;
+
+static double elapsed(struct timespec st, struct timespec et)
+{
+	return (double)(et.tv_sec - st.tv_sec) + (et.tv_nsec - st.tv_nsec) / 1e9;
+}
+
+static int past_deadline(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return elapsed(deadline, now) >= 0;
+}
+
+/* Sends the request on fd and reads the reply, returns 0 once the full
+ * reply has arrived. Closes fd. */
+static int request_on(int fd)
+{
+	static const char request[] = "revserver bench\n";
+	char reply[256];
+	size_t got = 0;
+
+	if (write(fd, request, sizeof request - 1) != (ssize_t)(sizeof request - 1)) {
+		close(fd);
+		return -1;
+	}
+
+	// The reply ends with the time stamp line
+	while (got < sizeof reply - 1) {
+		ssize_t n = read(fd, reply + got, sizeof reply - 1 - got);
+		if (n <= 0)
+			break;
+		got += n;
+		reply[got] = '\0';
+		if (strstr(reply, ">>>\n"))
+			break;
+	}
+
+	close(fd);
+	return got > 0 && strstr(reply, ">>>\n") ? 0 : -1;
+}
+
+/* One connection, returns 0 once the full reply has been read */
+static int do_request(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&server_addr, sizeof server_addr) < 0) {
+		close(fd);
+		return -1;
+	}
+	return request_on(fd);
+}
+
+/* Connects n sockets that send nothing yet. Each source address has only
+ * about 28k ephemeral ports, so they are spread over 127.0.1.x. Returns
+ * NULL when any connection fails. */
+static int *open_idle(long n)
+{
+	int *fds = malloc(n * sizeof *fds);
+	if (fds == NULL)
+		return NULL;
+
+	for (long i = 0; i < n; ++i) {
+		struct sockaddr_in src = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(0x7F000101 + i / IDLE_PER_ADDR),
+		};
+		int one = 1;
+		fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+		// Leave the port to connect(), bind() alone would also skip the
+		// ones used towards other servers or still in TIME_WAIT
+		if (fds[i] >= 0)
+			setsockopt(fds[i], IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof one);
+		if (fds[i] < 0 || bind(fds[i], (struct sockaddr *)&src, sizeof src) < 0 ||
+			connect(fds[i], (struct sockaddr *)&server_addr, sizeof server_addr) < 0) {
+			fprintf(stderr, "Idle connection %ld: ", i);
+			perror(NULL);
+			return NULL;
+		}
+	}
+	return fds;
+}
+
+static void *client_run(void *arg)
+{
+	client_stats *stats = arg;
+	while (!past_deadline()) {
+		if (do_request() == 0)
+			stats->requests++;
+		else
+			stats->failures++;
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	long clients = 8, seconds = 5, port = 4000, idle = 0;
+	for (int opt; (opt = getopt(argc, argv, "c:d:p:i:")) != -1;) {
+		long *dst = opt == 'c' ? &clients : opt == 'd' ? &seconds :
+			opt == 'p' ? &port : opt == 'i' ? &idle : NULL;
+		char *end = NULL;
+		if (dst)
+			*dst = strtol(optarg, &end, 10);
+		if (!dst || *end != '\0' || *dst < (opt == 'i' ? 0 : 1)) {
+			fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-p port] [-i idle]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	client_stats *stats = calloc(clients, sizeof *stats);
+	if (stats == NULL) {
+		fprintf(stderr, "Memory allocation error!!1 FATAL.");
+		return 1;
+	}
+
+	int *idle_fds = NULL;
+	if (idle > 0) {
+		struct rlimit rl;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+		idle_fds = open_idle(idle);
+		if (idle_fds == NULL)
+			return 1;
+		printf("%ld idle connections open\n", idle);
+	}
+
+	struct timespec st, et;
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	deadline = st;
+	deadline.tv_sec += seconds;
+
+	for (long i = 0; i < clients; ++i) {
+		if (pthread_create(&stats[i].thread, NULL, client_run, &stats[i]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	unsigned long requests = 0, failures = 0;
+	for (long i = 0; i < clients; ++i) {
+		pthread_join(stats[i].thread, NULL);
+		requests += stats[i].requests;
+		failures += stats[i].failures;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &et);
+
+	double secs = elapsed(st, et);
+	printf("%ld clients, %.2fs: %lu requests (%lu failed), %.0f requests/s\n",
+		clients, secs, requests, failures, requests / secs);
+
+	// Every idle connection must still be served. They are reset on close,
+	// their TIME_WAIT ports would fail the next run's connects
+	long answered = 0;
+	for (long i = 0; i < idle; ++i) {
+		struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(idle_fds[i], SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+		answered += request_on(idle_fds[i]) == 0;
+	}
+	if (idle > 0)
+		printf("%ld of %ld idle connections answered\n", answered, idle);
+
+	free(idle_fds);
+	free(stats);
+	return failures != 0 || answered != idle;
+}
@@ -2,8 +2,23 @@
  * @file revserver.c
  * @author Meeeeeeeeeeeeeee
  * @brief An asynchronous ipv4-TCP-socket server
+ *
+ * Usage: revserver [-w workers] [-b epoll|uring]
+ * Every worker is a thread pinned to a core, with its own listening socket
+ * on the same port (SO_REUSEPORT), event loop and connection table.
+ * The kernel spreads new connections over the listeners, so workers never
+ * share state. -w 0 starts one worker per core, the default is 1.
+ * The event loop uses epoll by default, or io_uring with -b uring. Both
+ * run the same handler, each connection on its own stackful coroutine
+ * (stackful-coro/coroutine.h).
+ *
+ * Build with -DTRACE_ENABLED to record the event loop into a trace file,
+ * see trace.h. Accepted and closed connections are logged unless built with
+ * NDEBUG, compare backends with that.
  */
 
+#define _GNU_SOURCE // pthread_setaffinity_np
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -15,12 +30,21 @@
 #include <time.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "stackful-coro/coroutine.h"
+#include "trace.h"
 
 #define LOG_ERROR(msg) \
 	fprintf(stderr, "%s:%d ERROR %s\n", __func__, __LINE__, (msg))
@@ -31,71 +55,193 @@
 
 #define IS_ASYNC_ERR(e) (e == EAGAIN || e == EWOULDBLOCK)
 
-/* Define a very limited version of coroutines using the switch statement.
- * Following should be noted:
- * 1: All CORO_AWAIT's should be placed between CORO_BEGIN and CORO_END.
- * 2: All declarations between CORO_BEGIN and CORO_END should be placed inside a block.
- * 3: io_call argument of CORO_AWAIT should evaluate to a negative value and
- *    set errno to EAGAIN or EWOULDBLOCK to indicate that no data is available,
- *    Linux IO system-calls follow this convention.
- * 4: Local variables inside the function using CORO_AWAIT are not preserved once
- *    after the function is suspend by CORO_AWAIT.
- * 5: The step argument of CORO_AWAIT's should be unique and in ascending order
- *    and should not be equal to 0 or UINT_MAX inside a coroutine. just start from 1 /-(^ ^)-/.
- * 6: The step state tracker should be declared using the CORO_STEP macro as the
- *    first argument of the async function, like: some_async_handler(CORO_STEP, int fd) { ... }.
- */
-#define CORO_STEP unsigned *cstep____
-
-#define CORO_BEGIN()      \
-	switch (*cstep____) { \
-	case 0:;
-
-#define CORO_AWAIT(step, ret_var, io_call)            \
-	case step:                                        \
-		do {                                          \
-			*cstep____ = step;                        \
-			ret_var = io_call;                        \
-			if (ret_var == -1 && IS_ASYNC_ERR(errno)) \
-				return -1;                            \
-		} while (0)
-
-#define CORO_END()        \
-	default:              \
-		*cstep____ = ~0U; \
-		}
-
 enum {
 	BACKLOG = 1024,
-	MAX_ACTIVE = 1024,
 	MAX_EVENTS = 64,
 	BUFFER_SIZE = 4096,
-};
-
-enum coro_status {
-	CORO_PENDING = -1,
-	CORO_DONE = 0,
-	CORO_FAIL = 1,
+	SLAB_CONNS = 64, /* Connections allocated at once */
+	SLOT_BITS = 24, /* Connections per worker, below 1 << SLOT_BITS */
+	PORT = 4000,
+	URING_ENTRIES = 1024,
+	URING_BUFFERS = 256, /* Provided receive buffers, a power of 2 */
 };
 
 typedef struct buffered_reader {
-	char buf[BUFFER_SIZE];
-	int at;
+	char *buf; /* BUFFER_SIZE bytes */
+	int at; /* Start of the data not consumed yet */
+	int len; /* End of the data read so far */
 	int fd;
+	/* With io_uring the data is already received, buf_read() copies it
+	 * from here instead of calling read() */
+	bool fed;
+	bool eof;
+	const char *pending;
+	int pending_len;
 } buffered_reader;
 
-int buf_read(buffered_reader *r) {
+/* Reads as much as fits after the unconsumed data, which is first moved to
+ * the front of the buffer. Returns like read(), the buffer must not be full.
+ */
+int buf_read(buffered_reader *r)
+{
+	if (r->at > 0) {
+		memmove(r->buf, r->buf + r->at, r->len - r->at);
+		r->len -= r->at;
+		r->at = 0;
+	}
+	assert(r->len < BUFFER_SIZE);
+
+	if (r->fed) {
+		if (r->pending_len == 0) {
+			if (r->eof)
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		int n = BUFFER_SIZE - r->len;
+		if (n > r->pending_len)
+			n = r->pending_len;
+		memcpy(r->buf + r->len, r->pending, n);
+		r->pending += n;
+		r->pending_len -= n;
+		r->len += n;
+		return n;
+	}
+
+	ssize_t n = read(r->fd, r->buf + r->len, BUFFER_SIZE - r->len);
+	if (n > 0)
+		r->len += n;
+	return (int)n;
+}
 
+/* Marks the first n bytes after r->at as consumed */
+static void buf_consume(buffered_reader *r, int n)
+{
+	assert(n <= r->len - r->at);
+	r->at += n;
 }
 
-typedef struct coroutine {
-	int fd; /* FD returned by accept and associated with fin field */
+typedef struct connection {
+	int fd; /* FD returned by accept, also used by buffer */
 	buffered_reader buffer;
-	unsigned step;
-	FILE *fin;
-	FILE *fout;
-	int (*fn)(unsigned *, FILE *, FILE *);
-} coroutine;
+	/* Runs handle_conn(), only from the first readable event until the
+	 * handler is done, idle connections cost no stack */
+	coro *co;
+	bool handled; /* handle_conn() returned */
+	struct uring *ring; /* Replies go through it, NULL with epoll */
+	uint32_t slot; /* Index in its conn_table */
+	uint32_t gen; /* Bumped when the slot is freed, never 0 */
+	uint32_t next_free;
+} connection;
+
+/* Generation above SLOT_BITS, slot below. Events carry this instead of the
+ * fd, so an event that arrives after its connection was closed finds a
+ * different generation, even if the slot or the fd was reused. 0 is never
+ * a connection, the listening socket uses it. */
+typedef uint64_t conn_id;
+
+#define LISTENER_ID ((conn_id)0)
+#define NO_SLOT UINT32_MAX
+
+/* Connections of one worker. They are allocated in slabs which never move,
+ * so the coroutines can keep pointers to them, and memory grows with the
+ * number of open connections rather than with the fd limit. */
+typedef struct conn_table {
+	connection **slabs;
+	uint32_t nslabs, slabs_cap;
+	uint32_t used; /* Slots ever handed out */
+	uint32_t free_slot; /* Head of the free list */
+} conn_table;
+
+static inline conn_id conn_id_of(const connection *c)
+{
+	return ((conn_id)c->gen << SLOT_BITS) | c->slot;
+}
+
+static inline connection *conn_slot(conn_table *t, uint32_t slot)
+{
+	return &t->slabs[slot / SLAB_CONNS][slot % SLAB_CONNS];
+}
+
+/* The connection behind id, NULL if it was closed since */
+static connection *conn_get(conn_table *t, conn_id id)
+{
+	uint32_t slot = id & ((1U << SLOT_BITS) - 1);
+	if (slot >= t->used)
+		return NULL;
+	connection *c = conn_slot(t, slot);
+	return c->gen == (uint32_t)(id >> SLOT_BITS) ? c : NULL;
+}
+
+/* A free slot, NULL when out of memory or slots */
+static connection *conn_alloc(conn_table *t)
+{
+	if (t->free_slot != NO_SLOT) {
+		connection *c = conn_slot(t, t->free_slot);
+		t->free_slot = c->next_free;
+		return c;
+	}
+	if (t->used == 1U << SLOT_BITS)
+		return NULL;
+
+	if (t->used == t->nslabs * SLAB_CONNS) {
+		if (t->nslabs == t->slabs_cap) {
+			uint32_t cap = t->slabs_cap ? t->slabs_cap * 2 : 16;
+			connection **slabs = realloc(t->slabs, cap * sizeof *slabs);
+			if (slabs == NULL)
+				return NULL;
+			t->slabs = slabs;
+			t->slabs_cap = cap;
+		}
+		connection *slab = malloc(SLAB_CONNS * sizeof *slab);
+		if (slab == NULL)
+			return NULL;
+		t->slabs[t->nslabs++] = slab;
+	}
+
+	connection *c = conn_slot(t, t->used);
+	c->slot = t->used++;
+	c->gen = 1;
+	return c;
+}
+
+static void conn_free(conn_table *t, connection *c)
+{
+	if (++c->gen == 0)
+		c->gen = 1;
+	c->next_free = t->free_slot;
+	t->free_slot = c->slot;
+}
+
+/* io_uring instance driven by raw system calls, see the backend below */
+typedef struct uring {
+	int fd;
+	// Submission queue, requests are queued locally until uring_submit()
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned sq_mask, sq_entries, sq_queued_tail;
+	struct io_uring_sqe *sqes;
+	// Completion queue
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	// Provided buffers that multishot receives pick from
+	struct io_uring_buf_ring *buf_ring;
+	char *buffers;
+	unsigned short buf_tail;
+	// Requests queued while chaining are hard-linked to run in order
+	bool chaining;
+	struct io_uring_sqe *chain_prev;
+} uring;
+
+/* One event loop, all fields are only used by its own thread */
+typedef struct reactor {
+	pthread_t thread;
+	int efd; /* epoll only */
+	uring *ring; /* io_uring only */
+	int sfd;
+	int open_connections;
+	conn_table conns;
+} reactor;
 
 static bool interrupted = false;
 
@@ -152,6 +298,9 @@ static int ipv4_server(struct sockaddr_in *saddr)
 		die("socket");
 	int value = 1;
 	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+	// Every worker binds its own socket to the same address
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0)
+		die("setsockopt: SO_REUSEPORT");
 
 	if (bind(sfd, TO_SADDRP(saddr), sizeof *saddr) < 0)
 		die("bind");
@@ -165,136 +314,618 @@ static int ipv4_server(struct sockaddr_in *saddr)
 	return sfd;
 }
 
-/* Stop accepting data, also triggers EPOLLRDHUP if registered with epoll */
-static void client_shutdown(FILE *fin) { shutdown(fileno(fin), SHUT_RD); }
-
-void close_connection(int rfd, int wfd)
+void info_peer(const char *tag, int fd)
 {
 	struct sockaddr_in addr;
 	socklen_t ssz = sizeof(addr);
-	getpeername(rfd, TO_SADDRP(&addr), &ssz);
+	getpeername(fd, TO_SADDRP(&addr), &ssz);
 
-	INFO("[CLOSED] ");
+	INFO("%s", tag);
 	debug_ipv4_addr(&addr);
 	INFO("\n");
-	close(rfd);
-	close(wfd);
 }
 
-int handle_async_conn(CORO_STEP, FILE *fin, FILE *fout)
+/* Logs every accept and close, which costs a getpeername() and a write to a
+ * terminal outside of the event loop's batching, so NDEBUG builds skip it
+ * with both backends */
+#ifdef NDEBUG
+#define LOG_PEER(tag, fd) ((void)0)
+#else
+#define LOG_PEER(tag, fd) info_peer((tag), (fd))
+#endif
+
+void close_connection(int fd)
+{
+	LOG_PEER("[CLOSED] ", fd);
+	close(fd);
+}
+
+// io_uring backend
+//---------------------------------------------------------
+// liburing is not needed for the few operations used here. Requests are
+// queued in the submission ring and the whole batch is submitted by the
+// single io_uring_enter() that also waits for completions, once per loop.
+// user_data holds the operation in its low bits and a conn_id (or the fd of
+// a close, the buffer of a send) above them.
+enum uring_op {
+	OP_ACCEPT = 1,
+	OP_RECV,
+	OP_SEND,
+	OP_CLOSE,
+	OP_BITS = 3,
+};
+
+#define UD(op, value) (((uint64_t)(value) << OP_BITS) | (op))
+
+/* Gives a receive buffer (back) to the kernel */
+static void uring_recycle(uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t)(u->buffers + (size_t)bid * BUFFER_SIZE);
+	buf->len = BUFFER_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_init(uring *u)
 {
-	int c = ' ';
+	// Completions are only processed inside io_uring_enter() of this thread
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+	};
+	u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd < 0)
+		die("io_uring_setup");
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		die("io_uring: IORING_FEAT_SINGLE_MMAP");
+	}
+
+	// Both rings share one mapping, the entries get their own
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	char *ring = mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		die("mmap: io_uring rings");
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		die("mmap: io_uring sqes");
+
+	u->sq_head = (unsigned *)(ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	u->sq_array = (unsigned *)(ring + p.sq_off.array);
+	u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_queued_tail = *u->sq_tail;
+	for (unsigned i = 0; i < p.sq_entries; ++i)
+		u->sq_array[i] = i;
+
+	u->cq_head = (unsigned *)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	// Receive buffers, the kernel picks one per completion
+	u->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buf_ring == MAP_FAILED)
+		die("mmap: io_uring buffer ring");
+	u->buffers = malloc((size_t)URING_BUFFERS * BUFFER_SIZE);
+	if (u->buffers == NULL)
+		die("malloc: io_uring buffers");
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)u->buf_ring,
+		.ring_entries = URING_BUFFERS,
+		.bgid = 0,
+	};
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		die("io_uring_register: IORING_REGISTER_PBUF_RING");
+	for (unsigned bid = 0; bid < URING_BUFFERS; ++bid)
+		uring_recycle(u, bid);
+}
 
-	CORO_BEGIN();
+/* Submits the queued requests and waits for at least wait_nr completions */
+static void uring_submit(uring *u, unsigned wait_nr)
+{
+	__atomic_store_n(u->sq_tail, u->sq_queued_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = u->sq_queued_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	TRACE_ZONE("io_uring_enter");
+	if (syscall(__NR_io_uring_enter, u->fd, to_submit, wait_nr, flags, NULL, 0) < 0 &&
+		errno != EINTR)
+		die("io_uring_enter");
+}
 
-	while (c != EOF) {
-		CORO_AWAIT(1, c, fgetc(fin));
-		c = toupper(c);
-		fputc(c, fout);
+/* Next free request, submits early if the ring is full, which also cuts
+ * a chain in two */
+static struct io_uring_sqe *uring_sqe(uring *u)
+{
+	if (u->sq_queued_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+		uring_submit(u, 0);
+		u->chain_prev = NULL;
+	}
+
+	struct io_uring_sqe *sqe = &u->sqes[u->sq_queued_tail++ & u->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	if (u->chaining) {
+		if (u->chain_prev)
+			u->chain_prev->flags |= IOSQE_IO_HARDLINK;
+		u->chain_prev = sqe;
+	}
+	return sqe;
+}
+
+/* Accepts connections until it fails or is cancelled */
+static void uring_accept(uring *u, int sfd)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = UD(OP_ACCEPT, LISTENER_ID);
+}
+
+/* Receives into provided buffers until EOF, an error or no free buffer */
+static void uring_recv(uring *u, int fd, conn_id id)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = UD(OP_RECV, id);
+}
+
+/* Sends both parts as one message, from a copy freed on completion */
+static void uring_send(uring *u, int fd, const char *data, int len,
+	const char *tail, int tail_len)
+{
+	if (len + tail_len == 0)
+		return;
+	char *msg = malloc(len + tail_len);
+	if (msg == NULL)
+		die("malloc: send");
+	memcpy(msg, data, len);
+	memcpy(msg + len, tail, tail_len);
+
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = len + tail_len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)msg | OP_SEND;
+}
+
+static void uring_close(uring *u, int fd)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = UD(OP_CLOSE, fd);
+}
+//---------------------------------------------------------
+
+/* Stop accepting data, also triggers EPOLLRDHUP if registered with epoll
+ * and ends the multishot receive with io_uring. Called directly for both,
+ * as IORING_OP_SHUTDOWN always goes through a kernel worker thread and
+ * replies still being sent are not affected. */
+static void client_shutdown(connection *c) { shutdown(c->fd, SHUT_RD); }
+
+/* Sends data in upper case, followed by the time if with_time is set, with
+ * one system call or request */
+static void send_reply(connection *c, char *data, int len, bool with_time)
+{
+	for (int i = 0; i < len; ++i)
+		data[i] = toupper((unsigned char)data[i]);
+
+	char time_line[64];
+	struct iovec iov[2] = {{data, len}, {time_line, 0}};
+	if (with_time) {
+		// ctime's buffer would be shared by all workers
+		char time_str[32];
+		time_t t = time(NULL);
+		ctime_r(&t, time_str);
+		*strchr(time_str, '\n') = '\0';
+		iov[1].iov_len = snprintf(time_line, sizeof time_line, "<<<  Time is: %s >>>\n", time_str);
+	}
+
+	if (c->ring) {
+		uring_send(c->ring, c->fd, data, len, time_line, iov[1].iov_len);
+		return;
+	}
+
+	ssize_t total = iov[0].iov_len + iov[1].iov_len;
+	if (writev(c->fd, iov, 2) != total)
+		LOG_ERROR("Reply not fully sent");
+}
+
+/* Answers the first line in upper case with the time appended. Lines longer
+ * than the buffer are sent on in parts. Runs on the connection's coroutine,
+ * which the event loop resumes once the fd is readable again. */
+static void handle_conn(void *arg)
+{
+	connection *c = arg;
+	buffered_reader *r = &c->buffer;
+	// Only connections being served need a buffer, it is on their stack
+	char buf[BUFFER_SIZE];
+	r->buf = buf;
+
+	while (1) {
+		int n = buf_read(r);
+		if (n < 0 && IS_ASYNC_ERR(errno)) {
+			coro_await_readable(c->fd);
+			continue;
+		}
+		if (n < 0)
+			break;
+		if (n == 0) {
+			// Peer is done sending, answer what came without the time
+			send_reply(c, r->buf + r->at, r->len - r->at, false);
+			break;
+		}
 
-		if (c == '\n') {
-			time_t t = time(NULL);
-			char *time_str = ctime(&t);
-			*strchr(time_str, '\n') = '\0';
-			fprintf(fout, "<<<  Time is: %s >>>\n", time_str);
+		// Only the bytes just read can hold the first newline
+		char *nl = memchr(r->buf + r->len - n, '\n', n);
+		if (nl != NULL) {
+			send_reply(c, r->buf + r->at, nl + 1 - (r->buf + r->at), true);
 			break;
 		}
+		if (r->len == BUFFER_SIZE) {
+			send_reply(c, r->buf + r->at, r->len - r->at, false);
+			buf_consume(r, r->len - r->at);
+		}
 	}
 
-	CORO_END();
-	client_shutdown(fin);
+	client_shutdown(c);
+}
 
-	return 0;
+/* Sets up the connection, its coroutine is created on the first resume */
+static void connection_init(connection *c, int fd, uring *ring)
+{
+	c->fd = fd;
+	c->buffer.buf = NULL; // Set by handle_conn()
+	c->buffer.at = c->buffer.len = 0;
+	c->buffer.fd = fd;
+	c->buffer.fed = ring != NULL;
+	c->buffer.eof = false;
+	c->buffer.pending_len = 0;
+	c->ring = ring;
+	c->co = NULL;
+	c->handled = false;
 }
 
-static inline int call_coro(coroutine c) { return (c.fn)(&c.step, c.fin, c.fout); }
+/* Takes a slot for the accepted fd, or closes it if there is none */
+static connection *connection_open(reactor *r, int fd)
+{
+	connection *c = conn_alloc(&r->conns);
+	if (c == NULL) {
+		LOG_ERROR("Connection table full");
+		close(fd);
+		return NULL;
+	}
+	connection_init(c, fd, r->ring);
+	return c;
+}
 
-static coroutine clients[MAX_ACTIVE * 2 + 3]; // 2FD per client and other ones!?
+/* Frees the slot once the fd is closed, later events for it are ignored */
+static void connection_release(reactor *r, connection *c)
+{
+	if (c->co)
+		coro_destroy(c->co);
+	conn_free(&r->conns, c);
+	TRACE_COUNTER("connections", --r->open_connections);
+}
 
-void handle_epoll_event(int efd, int sfd, struct epoll_event ev)
+/* Runs the handler until it waits for data again or is done */
+static void connection_resume(connection *c)
+{
+	if (c->handled)
+		return;
+	if (c->co == NULL) {
+		c->co = coro_create(handle_conn, c);
+		if (c->co == NULL) {
+			// Hang up, the connection is closed like any other
+			LOG_ERROR("No memory for a coroutine");
+			c->handled = true;
+			client_shutdown(c);
+			return;
+		}
+	}
+
+	TRACE_ZONE("coro_resume");
+	coro_resume(c->co);
+	// The stack goes back to the pool while the fd waits to be closed
+	if (coro_done(c->co)) {
+		coro_destroy(c->co);
+		c->co = NULL;
+		c->handled = true;
+	}
+}
+
+void handle_epoll_event(reactor *r, struct epoll_event ev)
 {
 	// If event on an already established connection
-	if (ev.data.fd != sfd) {
+	if (ev.data.u64 != LISTENER_ID) {
+		connection *c = conn_get(&r->conns, ev.data.u64);
+		if (c == NULL)
+			return; // Stale, the connection was closed since
+		// New data recieved, also when it came along with a hang up
+		if (ev.events & EPOLLIN)
+			connection_resume(c);
 		// Connection dropped
 		if (ev.events & EPOLLRDHUP) {
-			coroutine c = clients[ev.data.fd];
-			close_connection(fileno(c.fin), fileno(c.fout));
+			TRACE_ZONE("close");
+			close_connection(c->fd);
+			connection_release(r, c);
 			/* Closed FDs are auto-removed from epoll interest list */
-		} 
-		// New data recieved
-		else if (ev.events & EPOLLIN) {
-			call_coro(clients[ev.data.fd]);
-		} else {
+		} else if (!(ev.events & EPOLLIN)) {
 			die("epoll_event: conn_sock");
 		}
 		return;
 	}
 
 	// If server fd then try to accept connection
-	struct sockaddr_in saddr;
-	socklen_t ssz = sizeof saddr;
-	int cfd = accept(sfd, TO_SADDRP(&saddr), &ssz);
+	TRACE_ZONE("accept");
+	int cfd = accept(r->sfd, NULL, NULL);
+	if (cfd < 0) {
+		if (!IS_ASYNC_ERR(errno))
+			perror("accept");
+		return;
+	}
+	connection *c = connection_open(r, cfd);
+	if (c == NULL)
+		return;
 
 	setnonblocking(cfd);
 	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
-	ev.data.fd = cfd;
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev) < 0)
+	ev.data.u64 = conn_id_of(c);
+	if (epoll_ctl(r->efd, EPOLL_CTL_ADD, cfd, &ev) < 0)
 		die("epoll_ctl: conn_sock");
 
-	clients[cfd] = (coroutine){
-		.fd = cfd,
-		.fin = fdopen(cfd, "rb"),
-		.fout = fdopen(dup(cfd), "wb"),
-		.fn = handle_async_conn,
-	};
+	LOG_PEER("[RECIEV] ", cfd);
+	TRACE_COUNTER("connections", ++r->open_connections);
+}
 
-#ifndef NDEBUG
-	setlinebuf(clients[cfd].fin);
-	setlinebuf(clients[cfd].fout);
-#endif
+/* The same steps as handle_epoll_event(), driven by io_uring completions */
+static void handle_uring_cqe(reactor *r, struct io_uring_cqe *cqe)
+{
+	uring *u = r->ring;
+	int op = cqe->user_data & ((1 << OP_BITS) - 1);
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+
+	switch (op) {
+	case OP_ACCEPT: {
+		TRACE_ZONE("accept");
+		if (!more)
+			uring_accept(u, r->sfd);
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			perror("accept");
+			break;
+		}
+		connection *c = connection_open(r, cqe->res);
+		if (c == NULL)
+			break;
+		uring_recv(u, c->fd, conn_id_of(c));
+		LOG_PEER("[RECIEV] ", c->fd);
+		TRACE_COUNTER("connections", ++r->open_connections);
+		break;
+	}
 
-	INFO("[RECIEV] ");
-	debug_ipv4_addr(&saddr);
-	INFO("\n");
+	case OP_RECV: {
+		bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		connection *c = conn_get(&r->conns, cqe->user_data >> OP_BITS);
+		if (c == NULL) {
+			// Stale, the connection was closed since
+			if (has_buffer)
+				uring_recycle(u, bid);
+			break;
+		}
+		if (cqe->res > 0 && has_buffer) {
+			c->buffer.pending = u->buffers + (size_t)bid * BUFFER_SIZE;
+			c->buffer.pending_len = cqe->res;
+		} else if (cqe->res != -ENOBUFS) {
+			c->buffer.eof = true; // EOF, reset or our own shutdown
+		}
+
+		// Replies of this resume and the close after them run in order
+		u->chaining = true;
+		u->chain_prev = NULL;
+		connection_resume(c);
+
+		// Unread data is dropped once the handler is done, as with epoll
+		c->buffer.pending_len = 0;
+		if (has_buffer)
+			uring_recycle(u, bid);
+
+		bool eof = c->buffer.eof;
+		if (eof) {
+			TRACE_ZONE("close");
+			LOG_PEER("[CLOSED] ", c->fd);
+			uring_close(u, c->fd);
+			connection_release(r, c);
+		}
+		u->chaining = false;
+
+		if (!more && !eof)
+			uring_recv(u, c->fd, conn_id_of(c));
+		break;
+	}
+
+	case OP_SEND:
+		free((void *)(uintptr_t)(cqe->user_data & ~(uint64_t)((1 << OP_BITS) - 1)));
+		if (cqe->res < 0 && cqe->res != -EPIPE && cqe->res != -ECONNRESET)
+			LOG_ERROR("Reply not fully sent");
+		break;
+
+	default: // Close
+		break;
+	}
 }
 
-int main(void)
+static void reactor_init(reactor *r, struct sockaddr_in *saddr, bool use_uring)
 {
-	signal(SIGINT, sigint_handler);
-	atexit(exit_cleanup);
-
-	struct epoll_event ep_events[MAX_EVENTS];
-	struct sockaddr_in saddr = {
-		.sin_family = AF_INET,
-		.sin_port = htons(4000),
-		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
-	};
+	r->conns.free_slot = NO_SLOT;
+	r->sfd = ipv4_server(saddr);
+	setnonblocking(r->sfd);
+
+	if (use_uring) {
+		// Set up by the worker, the ring only takes its thread's requests
+		r->ring = calloc(1, sizeof *r->ring);
+		if (r->ring == NULL)
+			die("calloc: ring");
+		return;
+	}
 
-	int efd = epoll_create1(0);
-	if (efd < 0)
+	r->efd = epoll_create1(0);
+	if (r->efd < 0)
 		die("epoll_create1");
 
 	struct epoll_event ev;
-	int sfd = ipv4_server(&saddr);
-	// Setup server socket to be nonblocking and register into epoll
-	setnonblocking(sfd);
+	// Register the nonblocking server socket into epoll
 	ev.events = EPOLLIN;
-	ev.data.fd = sfd;
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) < 0)
+	ev.data.u64 = LISTENER_ID;
+	if (epoll_ctl(r->efd, EPOLL_CTL_ADD, r->sfd, &ev) < 0)
 		die("epoll_ctl: server_sock");
+}
+
+static void uring_run(reactor *r)
+{
+	uring *u = r->ring;
+	uring_init(u);
+	uring_accept(u, r->sfd);
 
 	while (1) {
-		int nfds = epoll_wait(efd, ep_events, MAX_EVENTS, -1);
+		// Everything queued by the previous round goes with this one call
+		uring_submit(u, 1);
+
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		TRACE_COUNTER("completions", tail - head);
+
+		TRACE_ZONE("dispatch");
+		for (; head != tail; ++head)
+			handle_uring_cqe(r, &u->cqes[head & u->cq_mask]);
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static void *reactor_run(void *arg)
+{
+	reactor *r = arg;
+	struct epoll_event ep_events[MAX_EVENTS];
+
+	if (r->ring) {
+		uring_run(r);
+		return NULL;
+	}
+
+	while (1) {
+		int nfds;
+		{
+			TRACE_ZONE("epoll_wait");
+			nfds = epoll_wait(r->efd, ep_events, MAX_EVENTS, -1);
+		}
 		if (nfds < 0)
 			die("epoll_wait");
+		TRACE_COUNTER("ready_events", nfds);
 
+		TRACE_ZONE("dispatch");
 		for (int i = 0; i < nfds; ++i)
-			handle_epoll_event(efd, sfd, ep_events[i]);
+			handle_epoll_event(r, ep_events[i]);
+	}
+
+	return NULL;
+}
+
+/* Pins worker i to the i-th core this process may run on */
+static void pin_to_core(pthread_t thread, int i)
+{
+	cpu_set_t allowed, set;
+	if (sched_getaffinity(0, sizeof allowed, &allowed) < 0)
+		die("sched_getaffinity");
+
+	int nth = i % CPU_COUNT(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			break;
+		}
+	}
+
+	int err = pthread_setaffinity_np(thread, sizeof set, &set);
+	if (err != 0) {
+		errno = err;
+		die("pthread_setaffinity_np");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long workers = 1;
+	bool use_uring = false;
+	for (int opt; (opt = getopt(argc, argv, "w:b:")) != -1;) {
+		char *end = "";
+		if (opt == 'w')
+			workers = strtol(optarg, &end, 10);
+		else if (opt == 'b' && strcmp(optarg, "uring") == 0)
+			use_uring = true;
+		else if (opt != 'b' || strcmp(optarg, "epoll") != 0)
+			end = NULL;
+
+		if (end == NULL || *end != '\0' || workers < 0) {
+			fprintf(stderr, "Usage: %s [-w workers] [-b epoll|uring]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (workers == 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	signal(SIGINT, sigint_handler);
+	atexit(exit_cleanup);
+
+	struct sockaddr_in saddr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	// Every connection is an fd, the soft limit is often only 1024
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		die("getrlimit");
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		perror("setrlimit: RLIMIT_NOFILE");
+
+	reactor *reactors = calloc(workers, sizeof *reactors);
+	if (reactors == NULL)
+		die("calloc: reactors");
+
+	INFO("Starting %ld %s worker(s)\n", workers, use_uring ? "io_uring" : "epoll");
+	for (long i = 0; i < workers; ++i)
+		reactor_init(&reactors[i], &saddr, use_uring);
+
+	for (long i = 0; i < workers; ++i) {
+		int err = pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]);
+		if (err != 0) {
+			errno = err;
+			die("pthread_create");
+		}
+		pin_to_core(reactors[i].thread, i);
 	}
 
-	// Not really needed for now, but anyways
-	close(sfd);
-	close(efd);
+	// Workers only stop by exiting the process, on SIGINT or an error
+	for (long i = 0; i < workers; ++i)
+		pthread_join(reactors[i].thread, NULL);
 
 	return 0;
 }
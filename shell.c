@@ -25,6 +25,7 @@ static jmp_buf interrupt_jmp;
 static void ctrlc_handler(int sig)
 {
 	assert(sig == SIGINT);
+	(void)sig;
 	siglongjmp(interrupt_jmp, 1);
 }
 
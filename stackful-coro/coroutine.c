@@ -0,0 +1,322 @@
+/**
+ * @file coroutine.c
+ * @brief Context switches, stacks and the pool behind coroutine.h
+ */
+
+#include "coroutine.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+
+#ifdef CORO_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+enum {
+	POOL_MAX = 256, /* Stacks kept per thread for reuse */
+};
+
+/* Lives at the top of its own stack mapping */
+struct coro {
+	void *sp; /* Saved stack pointer while suspended */
+	void *caller_sp; /* Where yielding returns to */
+	coro *caller; /* Running coroutine when this one was resumed */
+	coro_fn fn;
+	void *arg;
+	char *map; /* Guard page and stack */
+	int wait_fd;
+	bool done;
+	coro *next_free; /* In the pool */
+#ifdef CORO_ASAN
+	void *asan_fake_stack;
+	const void *caller_stack;
+	size_t caller_stack_size;
+#endif
+};
+
+static _Thread_local coro *current;
+static _Thread_local coro *pool;
+static _Thread_local unsigned pool_size;
+
+// Context switch
+//---------------------------------------------------------
+// coro_switch(from, to) pushes the callee-saved registers, stores the
+// stack pointer in *from, loads to as the stack pointer and pops the
+// registers saved there. A new stack is prepared to look like it was
+// switched away from right before coro_trampoline, which moves the
+// coroutine from a callee-saved register into the first argument and
+// calls coro_main().
+void coro_switch(void **from, void *to);
+void coro_trampoline(void);
+void coro_main(coro *co) __attribute__((noreturn, used));
+
+#if defined(__x86_64__)
+
+// mxcsr and the x87 control word are callee-saved too, they share a slot
+__asm__(
+	".text\n"
+	".globl coro_switch\n"
+	".type coro_switch, @function\n"
+	"coro_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_switch, .-coro_switch\n"
+
+	".globl coro_trampoline\n"
+	".type coro_trampoline, @function\n"
+	"coro_trampoline:\n"
+	"	movq %r12, %rdi\n"
+	"	call coro_main\n"
+	"	ud2\n"
+	".size coro_trampoline, .-coro_trampoline\n"
+);
+
+enum {
+	FRAME_WORDS = 8, /* Control words, 6 registers and the return address */
+	FRAME_CO = 4, /* r12 */
+	FRAME_RET = 7,
+};
+
+static void init_frame(uintptr_t *frame, coro *co)
+{
+	frame[0] = 0x1F80 | (uintptr_t)0x037F << 32; // Default mxcsr, x87 cw
+	frame[FRAME_CO] = (uintptr_t)co;
+	frame[FRAME_RET] = (uintptr_t)coro_trampoline;
+}
+
+#elif defined(__aarch64__)
+
+// x19-x28, the frame pointer, the link register and d8-d15
+__asm__(
+	".text\n"
+	".globl coro_switch\n"
+	".type coro_switch, %function\n"
+	"coro_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coro_switch, .-coro_switch\n"
+
+	".globl coro_trampoline\n"
+	".type coro_trampoline, %function\n"
+	"coro_trampoline:\n"
+	"	mov x0, x19\n"
+	"	bl coro_main\n"
+	"	brk #0\n"
+	".size coro_trampoline, .-coro_trampoline\n"
+);
+
+enum {
+	FRAME_WORDS = 20,
+	FRAME_CO = 0, /* x19 */
+	FRAME_RET = 11, /* x30 */
+};
+
+static void init_frame(uintptr_t *frame, coro *co)
+{
+	frame[FRAME_CO] = (uintptr_t)co;
+	frame[FRAME_RET] = (uintptr_t)coro_trampoline;
+}
+
+#else
+#error "stackful-coro: context switches are only written for x86-64 and aarch64"
+#endif
+//---------------------------------------------------------
+
+// ASan has to be told about stack switches, or it reports the other
+// stack's frames as errors
+#ifdef CORO_ASAN
+#define ASAN_START_SWITCH(fake, bottom, size) __sanitizer_start_switch_fiber(fake, bottom, size)
+#define ASAN_FINISH_SWITCH(fake, bottom, size) __sanitizer_finish_switch_fiber(fake, bottom, size)
+#define ASAN_UNPOISON(addr, size) ASAN_UNPOISON_MEMORY_REGION(addr, size)
+#else
+#define ASAN_START_SWITCH(fake, bottom, size) ((void)0)
+#define ASAN_FINISH_SWITCH(fake, bottom, size) ((void)0)
+#define ASAN_UNPOISON(addr, size) ((void)0)
+#endif
+
+static size_t page_size(void)
+{
+	static size_t size;
+	if (size == 0)
+		size = (size_t)sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+#ifdef CORO_ASAN
+/* Usable stack, between the guard page and the coro */
+static char *stack_bottom(const coro *co) { return co->map + page_size(); }
+static size_t stack_size(const coro *co) { return (char *)co - stack_bottom(co); }
+#endif
+
+static size_t map_size(void)
+{
+	size_t page = page_size();
+	size_t header = (sizeof(coro) + page - 1) / page * page;
+	return page + (CORO_STACK_SIZE + page - 1) / page * page + header;
+}
+
+static coro *alloc_coro(void)
+{
+	coro *co = pool;
+	if (co) {
+		pool = co->next_free;
+		--pool_size;
+		// Frames of a coroutine destroyed while suspended stay poisoned
+		ASAN_UNPOISON(stack_bottom(co), stack_size(co));
+		return co;
+	}
+
+	size_t size = map_size();
+	char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	// Overflowing the stack faults instead of overwriting other memory
+	if (mprotect(map, page_size(), PROT_NONE) < 0) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	co = (coro *)(map + size) - 1;
+	co->map = map;
+	return co;
+}
+
+coro *coro_create(coro_fn fn, void *arg)
+{
+	coro *co = alloc_coro();
+	if (co == NULL)
+		return NULL;
+
+	co->fn = fn;
+	co->arg = arg;
+	co->caller = NULL;
+	co->wait_fd = -1;
+	co->done = false;
+
+	// The first frame sits right below the coro, 16-byte aligned once
+	// the trampoline's return address is popped
+	uintptr_t top = (uintptr_t)co & ~(uintptr_t)15;
+	uintptr_t *frame = (uintptr_t *)top - FRAME_WORDS;
+	for (int i = 0; i < FRAME_WORDS; ++i)
+		frame[i] = 0;
+	init_frame(frame, co);
+	co->sp = frame;
+
+	return co;
+}
+
+void coro_destroy(coro *co)
+{
+	assert(co != current);
+	if (pool_size < POOL_MAX) {
+		co->next_free = pool;
+		pool = co;
+		++pool_size;
+	} else {
+		munmap(co->map, map_size());
+	}
+}
+
+void coro_main(coro *co)
+{
+	ASAN_FINISH_SWITCH(NULL, &co->caller_stack, &co->caller_stack_size);
+	co->fn(co->arg);
+	co->done = true;
+
+	// Nothing comes back here, ASan can forget this stack's fake frames
+	current = co->caller;
+	ASAN_START_SWITCH(NULL, co->caller_stack, co->caller_stack_size);
+	coro_switch(&co->sp, co->caller_sp);
+	__builtin_unreachable();
+}
+
+void coro_resume(coro *co)
+{
+	assert(!co->done && co != current);
+	co->caller = current;
+	co->wait_fd = -1;
+	current = co;
+
+#ifdef CORO_ASAN
+	void *fake_stack = NULL;
+#endif
+	ASAN_START_SWITCH(&fake_stack, stack_bottom(co), stack_size(co));
+	coro_switch(&co->caller_sp, co->sp);
+	ASAN_FINISH_SWITCH(fake_stack, NULL, NULL);
+}
+
+void coro_yield(void)
+{
+	coro *co = current;
+	assert(co != NULL);
+	current = co->caller;
+
+	ASAN_START_SWITCH(&co->asan_fake_stack, co->caller_stack, co->caller_stack_size);
+	coro_switch(&co->sp, co->caller_sp);
+	ASAN_FINISH_SWITCH(co->asan_fake_stack, &co->caller_stack, &co->caller_stack_size);
+}
+
+void coro_await_readable(int fd)
+{
+	coro *co = current;
+	assert(co != NULL);
+	co->wait_fd = fd;
+	coro_yield();
+}
+
+coro *coro_current(void) { return current; }
+bool coro_done(const coro *co) { return co->done; }
+int coro_waiting_fd(const coro *co) { return co->wait_fd; }
@@ -0,0 +1,68 @@
+/**
+ * @file coroutine.h
+ * @brief Stackful coroutines with hand-written context switches
+ *
+ * Every coroutine runs on its own stack, so it can suspend from any depth
+ * and keeps its locals, unlike the switch based macros. A switch saves only
+ * the callee-saved registers (x86-64 and aarch64). Stacks are mmap()ed
+ * with a guard page below them and are kept in a per-thread pool, so
+ * creating a coroutine after the first few costs no system call.
+ *
+ *     static void handler(void *arg)
+ *     {
+ *         while (read(fd, buf, n) < 0 && errno == EAGAIN)
+ *             coro_await_readable(fd); // Back to the event loop
+ *         ...
+ *     }
+ *
+ *     coro *co = coro_create(handler, arg);
+ *     coro_resume(co);                 // Runs until it waits or returns
+ *     ...
+ *     if (coro_waiting_fd(co) == ready_fd)
+ *         coro_resume(co);
+ *     ...
+ *     coro_destroy(co);
+ *
+ * A coroutine belongs to the thread that created it. Destroying one that
+ * is suspended just drops its stack, nothing on it is cleaned up.
+ *
+ * Every stack is its own mapping, split in two by the guard page, so
+ * vm.max_map_count (65530 by default) allows about 32k live coroutines per
+ * process, fewer if the program maps much else. Create them when there is
+ * work, not per idle object, or raise the sysctl. coro_create() returns
+ * NULL at the limit.
+ */
+
+#ifndef PROJECTS_SILLY_COROUTINE_H
+#define PROJECTS_SILLY_COROUTINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef CORO_STACK_SIZE
+#define CORO_STACK_SIZE (64 * 1024) /* Usable bytes, without the guard page */
+#endif
+
+typedef struct coro coro;
+typedef void (*coro_fn)(void *arg);
+
+/* A new coroutine which runs fn(arg) once resumed, NULL if out of memory */
+coro *coro_create(coro_fn fn, void *arg);
+/* Gives its stack back to the pool of the calling thread */
+void coro_destroy(coro *co);
+
+/* Runs co until it yields, waits or returns, co must not be done */
+void coro_resume(coro *co);
+/* Suspends the running coroutine, its coro_resume() returns */
+void coro_yield(void);
+/* Yields until resumed by an event loop, which should do that once fd is
+ * readable, see coro_waiting_fd() */
+void coro_await_readable(int fd);
+
+/* The running coroutine, NULL outside of any */
+coro *coro_current(void);
+bool coro_done(const coro *co);
+/* fd passed to coro_await_readable() while co waits on it, -1 otherwise */
+int coro_waiting_fd(const coro *co);
+
+#endif // End coroutine.h
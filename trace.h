@@ -0,0 +1,233 @@
+/**
+ * @file trace.h
+ * @brief Timeline tracing for C and C++ programs, viewable in Perfetto
+ *
+ * Build with -DTRACE_ENABLED to record, without it every macro compiles to
+ * nothing. Each thread appends to its own ring buffer of TRACE_BUFFER_EVENTS
+ * events, so once it is full the oldest events are overwritten and only
+ * the tail of a long run is kept. At exit all buffers are written as Chrome
+ * trace-event JSON to $TRACE_FILE, or trace-<pid>.json when it is not set.
+ * Open that with https://ui.perfetto.dev or a locally served copy of it.
+ *
+ *     TRACE_ZONE("parse");            // Timed until the end of the scope
+ *     TRACE_COUNTER("clients", n);    // Value plotted over time
+ *
+ * Counters get a track per thread, as "<name> id: <tid>". Names must be
+ * string literals (or live until exit), only the pointer is stored. The
+ * recorder state is per translation unit, which is enough as every program
+ * here is a single file. Threads still running at exit may lose their
+ * latest events. In C zones need the GNU cleanup attribute and are not
+ * recorded when left by longjmp.
+ */
+
+#ifndef PROJECTS_SILLY_TRACE_H
+#define PROJECTS_SILLY_TRACE_H
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+
+#ifdef TRACE_ENABLED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef TRACE_BUFFER_EVENTS
+#define TRACE_BUFFER_EVENTS (1 << 16)
+#endif
+
+#ifdef __cplusplus
+#define TRACE_TLS thread_local
+#else
+#define TRACE_TLS _Thread_local
+#endif
+
+enum trace_phase {
+	TRACE_PHASE_ZONE = 'X',
+	TRACE_PHASE_COUNTER = 'C',
+};
+
+typedef struct trace_event {
+	const char *name;
+	uint64_t ts; /* Nanoseconds, CLOCK_MONOTONIC */
+	union {
+		uint64_t dur; /* Zones */
+		double value; /* Counters */
+	};
+	char phase;
+} trace_event;
+
+typedef struct trace_buffer {
+	struct trace_buffer *next;
+	uint64_t written; /* Events ever added, the ring holds the last ones */
+	long tid;
+	trace_event events[TRACE_BUFFER_EVENTS];
+} trace_buffer;
+
+/* Buffers of all threads, kept after a thread exits so they can be written */
+static trace_buffer *trace_buffers;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TRACE_TLS trace_buffer *trace_local;
+
+static inline uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void trace_write_name(FILE *out, const char *name)
+{
+	for (; *name; ++name) {
+		if (*name == '"' || *name == '\\')
+			fputc('\\', out);
+		fputc(*name, out);
+	}
+}
+
+static inline void trace_flush(void)
+{
+	const char *path = getenv("TRACE_FILE");
+	char default_path[64];
+	if (path == NULL) {
+		snprintf(default_path, sizeof default_path, "trace-%ld.json", (long)getpid());
+		path = default_path;
+	}
+
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		perror("trace: fopen");
+		return;
+	}
+
+	long pid = (long)getpid();
+	const char *sep = "\n";
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	pthread_mutex_lock(&trace_lock);
+	for (trace_buffer *buf = trace_buffers; buf; buf = buf->next) {
+		uint64_t first = 0;
+		if (buf->written > TRACE_BUFFER_EVENTS)
+			first = buf->written - TRACE_BUFFER_EVENTS;
+
+		for (uint64_t i = first; i < buf->written; ++i) {
+			const trace_event *ev = &buf->events[i % TRACE_BUFFER_EVENTS];
+			fprintf(out, "%s{\"name\":\"", sep);
+			trace_write_name(out, ev->name);
+			fprintf(out, "\",\"ph\":\"%c\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f",
+				ev->phase, pid, buf->tid, ev->ts / 1e3);
+			if (ev->phase == TRACE_PHASE_ZONE)
+				fprintf(out, ",\"dur\":%.3f}", ev->dur / 1e3);
+			else
+				fprintf(out, ",\"id\":%ld,\"args\":{\"value\":%.17g}}", buf->tid,
+					ev->value);
+			sep = ",\n";
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	fprintf(out, "\n]}\n");
+	if (fclose(out) != 0)
+		perror("trace: fclose");
+	else
+		fprintf(stderr, "Trace written to %s\n", path);
+}
+
+/* Buffer of the calling thread, the first one also sets up the exit flush */
+static inline trace_buffer *trace_buffer_get(void)
+{
+	if (trace_local)
+		return trace_local;
+
+	trace_buffer *buf = (trace_buffer *)calloc(1, sizeof *buf);
+	if (buf == NULL)
+		return NULL;
+	buf->tid = (long)syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_buffers == NULL)
+		atexit(trace_flush);
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	pthread_mutex_unlock(&trace_lock);
+
+	return trace_local = buf;
+}
+
+static inline trace_event *trace_push(const char *name, char phase, uint64_t ts)
+{
+	trace_buffer *buf = trace_buffer_get();
+	if (buf == NULL)
+		return NULL;
+
+	trace_event *ev = &buf->events[buf->written++ % TRACE_BUFFER_EVENTS];
+	ev->name = name;
+	ev->phase = phase;
+	ev->ts = ts;
+	return ev;
+}
+
+static inline void trace_counter(const char *name, double value)
+{
+	trace_event *ev = trace_push(name, TRACE_PHASE_COUNTER, trace_now());
+	if (ev)
+		ev->value = value;
+}
+
+typedef struct trace_zone {
+	const char *name;
+	uint64_t start;
+} trace_zone;
+
+static inline trace_zone trace_zone_begin(const char *name)
+{
+	trace_zone zone = {name, trace_now()};
+	return zone;
+}
+
+/* The zone is recorded when it ends, a zone cut in half by the ring never
+ * shows up */
+static inline void trace_zone_end(const trace_zone *zone)
+{
+	uint64_t end = trace_now();
+	trace_event *ev = trace_push(zone->name, TRACE_PHASE_ZONE, zone->start);
+	if (ev)
+		ev->dur = end - zone->start;
+}
+
+#ifdef __cplusplus
+struct trace_scope {
+	trace_zone zone;
+
+	explicit trace_scope(const char *name)
+		: zone(trace_zone_begin(name))
+	{
+	}
+	~trace_scope() { trace_zone_end(&zone); }
+
+	trace_scope(const trace_scope &) = delete;
+	trace_scope &operator=(const trace_scope &) = delete;
+};
+
+#define TRACE_ZONE(name) trace_scope TRACE_CAT(trace_zone_, __LINE__)(name)
+#else
+#define TRACE_ZONE(name)                                               \
+	__attribute__((cleanup(trace_zone_end))) trace_zone TRACE_CAT( \
+		trace_zone_, __LINE__                                      \
+	) = trace_zone_begin(name)
+#endif
+
+#define TRACE_COUNTER(name, value) trace_counter((name), (double)(value))
+
+#else // TRACE_ENABLED
+
+#define TRACE_ZONE(name) ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+
+#endif // TRACE_ENABLED
+
+#endif // End trace.h